@@ -12,10 +12,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <math.h>
+#include <pthread.h>
 #ifdef WIN64
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
 #endif
 
 // Define the engine version:
@@ -140,7 +148,8 @@ enum
 	b,
 	r,
 	q,
-	k
+	k,
+	no_piece
 };
 
 const char *square_to_coordinates[] = {
@@ -241,16 +250,6 @@ char promoted_pieces[] = {
 
 */
 
-// Defining the bitboards:
-U64 bitboards[12];
-U64 occupancies[3];
-
-// Side to move:
-int side;
-
-// Enpassant square:
-int enpassant = no_sq;
-
 /*
 
 	= CASTLING BITS
@@ -267,20 +266,41 @@ int enpassant = no_sq;
 
 */
 
-// Castling rights:
-int castle;
+// NNUE hidden layer size (accumulator width of each perspective):
+#define nnue_hidden 256
 
-// "Almost" unique position identifier (aka hash key or position key):
-U64 hash_key;
-
-// Positions repetition table:
-U64 repetition_table[1000];
-
-// Repetition index:
-int repetition_index;
-
-// Half move counter:
-int ply;
+// Position (board state) data structure:
+typedef struct
+{
+	// Defining the bitboards:
+	U64 bitboards[12];
+	U64 occupancies[3];
+	// Piece on each square (no_piece when empty), kept in sync with the bitboards:
+	int board[64];
+	// Side to move:
+	int side;
+	// Enpassant square:
+	int enpassant;
+	// Castling rights:
+	int castle;
+	// "Almost" unique position identifier (aka hash key or position key):
+	U64 hash_key;
+	// Pawns only hash key (pawn hash tables):
+	U64 pawn_key;
+	// Material and piece-square scores [opening/endgame] (white minus black), kept up to date by make_move:
+	int piece_square[2];
+	// Game phase score (non pawn material of both sides), kept up to date by make_move:
+	int phase_score;
+	// NNUE accumulators [perspective] (only kept up to date while NNUE is in use):
+	short accumulator[2][nnue_hidden];
+	// Positions repetition table:
+	U64 repetition_table[1000];
+	// Repetition index:
+	int repetition_index;
+} position;
+
+// Game position (the one set up by the GUI/user):
+position root_position;
 
 /******************************************************************************\
 =========================== TIME CONTROL VARIABLES =============================
@@ -296,7 +316,7 @@ int movestogo = 30;
 int movetime = -1;
 
 // UCI <time> command holder (ms):
-int time = -1;
+int time_left = -1;
 
 // UCI <inc> commands time increment holder:
 int inc = 0;
@@ -310,8 +330,8 @@ int stoptime = 0;
 // Variable to flag time control availability:
 int timeset = 0;
 
-// Variable to flag when the time is up:
-int stopped = 0;
+// Variable to flag when the time is up (shared by all search threads):
+volatile int stopped = 0;
 
 /******************************************************************************\
 =========================== MISCELLANEOUS FUNCTIONS ============================
@@ -432,6 +452,9 @@ void read_input()
 	}
 }
 
+// Listen to GUI input while searching (off for deterministic bench runs):
+int listen_input = 1;
+
 // A bridge function to interact between search and GUI input:
 static void communicate()
 {
@@ -442,7 +465,104 @@ static void communicate()
 		stopped = 1;
 	}
 	// Read GUI input:
-	read_input();
+	if (listen_input)
+	{
+		read_input();
+	}
+}
+
+/*
+	Big lookup tables (the transposition table and the slider attack tables) are
+	probed at random, so with 4KB pages nearly every probe misses the TLB. They
+	are put on explicit huge pages when the system has some reserved (1GB pages
+	for sizes that are a multiple of 1GB, 2MB pages otherwise), on transparent
+	huge pages through madvise otherwise, and on plain pages as a last resort.
+*/
+
+// Memory page modes:
+enum
+{
+	plain_pages,
+	transparent_huge_pages,
+	huge_pages_2mb,
+	huge_pages_1gb
+};
+
+// Memory page mode names:
+const char *page_mode_names[] = {"plain pages", "transparent huge pages", "2MB huge pages", "1GB huge pages"};
+
+// Huge page sizes:
+#define huge_page_2mb 0x200000ULL
+#define huge_page_1gb 0x40000000ULL
+
+#if defined(MAP_HUGETLB) && !defined(MAP_HUGE_1GB)
+#define MAP_HUGE_1GB (30 << 26)
+#endif
+
+// Allocate memory aligned to (at least) a cache line, on huge pages when possible:
+void *large_page_alloc(U64 size, int *mode)
+{
+#ifdef WIN64
+	// Plain pages:
+	*mode = plain_pages;
+	return _aligned_malloc(size, 64);
+#else
+	// Size rounded up to whole 2MB pages:
+	U64 rounded = (size + huge_page_2mb - 1) & ~(huge_page_2mb - 1);
+	void *memory;
+#ifdef MAP_HUGETLB
+	// Explicit 1GB huge pages:
+	if ((rounded & (huge_page_1gb - 1)) == 0)
+	{
+		memory = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+		if (memory != MAP_FAILED)
+		{
+			*mode = huge_pages_1gb;
+			return memory;
+		}
+	}
+	// Explicit 2MB huge pages:
+	memory = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (memory != MAP_FAILED)
+	{
+		*mode = huge_pages_2mb;
+		return memory;
+	}
+#endif
+#ifdef MADV_HUGEPAGE
+	// Transparent huge pages on 2MB aligned memory:
+	memory = aligned_alloc(huge_page_2mb, rounded);
+	if (memory != NULL)
+	{
+		*mode = madvise(memory, rounded, MADV_HUGEPAGE) ? plain_pages : transparent_huge_pages;
+		return memory;
+	}
+#endif
+	// Plain pages:
+	*mode = plain_pages;
+	return aligned_alloc(64, (size + 63) & ~63ULL);
+#endif
+}
+
+// Free memory allocated with large_page_alloc:
+void large_page_free(void *memory, U64 size, int mode)
+{
+	// Nothing to free:
+	if (memory == NULL)
+	{
+		return;
+	}
+#ifdef WIN64
+	_aligned_free(memory);
+#else
+	// Explicit huge pages are unmapped:
+	if (mode == huge_pages_2mb || mode == huge_pages_1gb)
+	{
+		munmap(memory, (size + huge_page_2mb - 1) & ~(huge_page_2mb - 1));
+		return;
+	}
+	free(memory);
+#endif
 }
 
 /******************************************************************************\
@@ -481,6 +601,22 @@ U64 get_random_U64_number()
 	return n1 | (n2 << 16) | (n3 << 32) | (n4 << 48);
 }
 
+// Hash key random number state:
+U64 hash_random_state = 0x9e3779b97f4a7c15ULL;
+
+// Generate 64-bit hash keys (SplitMix64: unlike the XOR shift above it is not
+// linear, so XORs of a few keys do not cancel out into false key matches):
+U64 get_random_hash_key()
+{
+	// Advance the state:
+	U64 number = (hash_random_state += 0x9e3779b97f4a7c15ULL);
+	// Mix the bits:
+	number = (number ^ (number >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	number = (number ^ (number >> 27)) * 0x94d049bb133111ebULL;
+	// Return the random number:
+	return number ^ (number >> 31);
+}
+
 // Generate magic number candidate:
 U64 generate_magic_number()
 {
@@ -496,21 +632,81 @@ U64 generate_magic_number()
 #define get_bit(bitboard, square) ((bitboard) & (1ULL << (square)))
 #define pop_bit(bitboard, square) ((bitboard) &= ~(1ULL << (square)))
 
+/*
+	Bit counting and bit scanning are the hottest primitives of the engine.
+	x86-64 has dedicated instructions for both (POPCNT and BSF/TZCNT), but
+	POPCNT is missing on older CPUs, so the backend is picked at startup by
+	init_cpu_features() and the portable versions remain as a fallback.
+*/
+
+// Hardware bit counting/scanning availability (detected at startup):
+int hardware_popcnt = 0;
+int hardware_bitscan = 0;
+
+// Hardware parallel bit extract availability (BMI2, detected at startup):
+int hardware_pext = 0;
+
+// Hardware vector extensions availability (NNUE kernels, detected at startup):
+int hardware_avx2 = 0;
+int hardware_sse41 = 0;
+
+// De Bruijn sequence and lookup table for the portable bit scan:
+const U64 debruijn64 = 0x03f79d71b4cb0a89ULL;
+const int debruijn_index64[64] = {
+		0, 1, 48, 2, 57, 49, 28, 3,
+		61, 58, 50, 42, 38, 29, 17, 4,
+		62, 55, 59, 36, 53, 51, 43, 22,
+		45, 39, 33, 30, 24, 18, 12, 5,
+		63, 47, 56, 27, 60, 41, 37, 16,
+		54, 35, 52, 21, 44, 32, 23, 11,
+		46, 26, 40, 15, 34, 20, 31, 10,
+		25, 14, 19, 9, 13, 8, 7, 6};
+
+// Detect CPU features used by the bit manipulation primitives:
+void init_cpu_features()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	// Initialize CPU features detection:
+	__builtin_cpu_init();
+	// POPCNT came with SSE4.2/SSE4a:
+	hardware_popcnt = __builtin_cpu_supports("popcnt");
+	// BSF is baseline x86-64 (TZCNT is encoded as REP BSF, so it works everywhere):
+	hardware_bitscan = 1;
+	// PEXT came with BMI2:
+	hardware_pext = __builtin_cpu_supports("bmi2");
+	// Vector extensions for the NNUE kernels:
+	hardware_avx2 = __builtin_cpu_supports("avx2");
+	hardware_sse41 = __builtin_cpu_supports("sse4.1");
+#elif defined(__GNUC__)
+	// Builtins map to native instructions on other architectures:
+	hardware_popcnt = 1;
+	hardware_bitscan = 1;
+#endif
+}
+
 // Count bits wihin a bitboard:
 static inline int count_bits(U64 bitboard)
 {
-	// Bit counter:
-	int count = 0;
-	// Concecutively reset least significant first bit:
-	while (bitboard)
+#if defined(__GNUC__)
+	// Use hardware population count:
+	if (hardware_popcnt)
 	{
-		// Increment count:
-		count++;
-		// Reset least significant first bit:
-		bitboard &= bitboard - 1;
+#if defined(__x86_64__) && !defined(__POPCNT__)
+		// Emit POPCNT directly (the builtin would call into libgcc without -mpopcnt):
+		U64 count;
+		__asm__("popcntq %1, %0" : "=r"(count) : "r"(bitboard));
+		return (int)count;
+#else
+		return __builtin_popcountll(bitboard);
+#endif
 	}
+#endif
+	// Portable SWAR population count:
+	bitboard -= (bitboard >> 1) & 0x5555555555555555ULL;
+	bitboard = (bitboard & 0x3333333333333333ULL) + ((bitboard >> 2) & 0x3333333333333333ULL);
+	bitboard = (bitboard + (bitboard >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
 	// Return bit count:
-	return count;
+	return (int)((bitboard * 0x0101010101010101ULL) >> 56);
 }
 
 // Get least significant first bit index:
@@ -519,8 +715,15 @@ static inline int get_ls1b_index(U64 bitboard)
 	// Be sure that the bitboard is not ZERO:
 	if (bitboard)
 	{
-		// Count trailing bits before LS1B:
-		return count_bits((bitboard & -bitboard) - 1);
+#if defined(__GNUC__)
+		// Use hardware bit scan (TZCNT/BSF):
+		if (hardware_bitscan)
+		{
+			return __builtin_ctzll(bitboard);
+		}
+#endif
+		// Isolate LS1B and look its index up with De Bruijn multiplication:
+		return debruijn_index64[((bitboard & -bitboard) * debruijn64) >> 58];
 	}
 	// If the bitboard is ZERO:
 	else
@@ -529,6 +732,29 @@ static inline int get_ls1b_index(U64 bitboard)
 	}
 }
 
+// Extract the bits selected by mask into the low bits of the result (PEXT):
+static inline U64 pext(U64 bitboard, U64 mask)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	// Emit PEXT directly (callers only get here when BMI2 was detected):
+	U64 result;
+	__asm__("pextq %2, %1, %0" : "=r"(result) : "r"(bitboard), "r"(mask));
+	return result;
+#else
+	// Portable bit by bit extraction:
+	U64 result = 0ULL;
+	for (U64 bit = 1ULL; mask; bit <<= 1)
+	{
+		// Copy the lowest masked bit:
+		if (bitboard & mask & -mask)
+			result |= bit;
+		// Move on to the next masked bit:
+		mask &= mask - 1;
+	}
+	return result;
+#endif
+}
+
 /******************************************************************************\
 ================================ ZOBRIST KEYS ==================================
 \******************************************************************************/
@@ -545,11 +771,14 @@ U64 castle_keys[16];
 // Random side key:
 U64 side_key;
 
+// Random pawn key base (so positions without pawns do not match empty pawn hash entries):
+U64 pawn_base_key;
+
 // Initializate random hash keys:
 void init_random_keys()
 {
 	// Update pseudo random number state:
-	random_state = 1804289383;
+	hash_random_state = 0x9e3779b97f4a7c15ULL;
 	// Loop over piece codes:
 	for (int piece = P; piece <= k; piece++)
 	{
@@ -557,27 +786,29 @@ void init_random_keys()
 		for (int square = 0; square < 64; square++)
 		{
 			// Initialiazte random piece keys:
-			piece_keys[piece][square] = get_random_U64_number();
+			piece_keys[piece][square] = get_random_hash_key();
 		}
 	}
 	// Loop over board squares:
 	for (int square = 0; square < 64; square++)
 	{
 		// Initializate random enpassant keys:
-		enpassant_keys[square] = get_random_U64_number();
+		enpassant_keys[square] = get_random_hash_key();
 	}
 	// Loop over castling keys:
 	for (int index = 0; index < 16; index++)
 	{
 		// Initializate castling keys:
-		castle_keys[index] = get_random_U64_number();
+		castle_keys[index] = get_random_hash_key();
 	}
 	// Initializate random side key:
-	side_key = get_random_U64_number();
+	side_key = get_random_hash_key();
+	// Initializate pawn key base:
+	pawn_base_key = get_random_hash_key();
 }
 
 // Generate "almost" unique position identifier (aka hash key) from scratch:
-U64 generate_hash_key()
+U64 generate_hash_key(position *pos)
 {
 	// Final hash key:
 	U64 final_key = 0ULL;
@@ -587,7 +818,7 @@ U64 generate_hash_key()
 	for (int piece = P; piece <= k; piece++)
 	{
 		// Initialize piece bitboard copy:
-		bitboard = bitboards[piece];
+		bitboard = pos->bitboards[piece];
 		// Loop over the piece within a given bitboard:
 		while (bitboard)
 		{
@@ -600,15 +831,15 @@ U64 generate_hash_key()
 		}
 	}
 	// If enpassant square is available:
-	if (enpassant != no_sq)
+	if (pos->enpassant != no_sq)
 	{
 		// Hash enpassant:
-		final_key ^= enpassant_keys[enpassant];
+		final_key ^= enpassant_keys[pos->enpassant];
 	}
 	// Hash the castling rights:
-	final_key ^= castle_keys[castle];
+	final_key ^= castle_keys[pos->castle];
 	// Hash the side only if its black turn:
-	if (side == black)
+	if (pos->side == black)
 	{
 		final_key ^= side_key;
 	}
@@ -616,6 +847,410 @@ U64 generate_hash_key()
 	return final_key;
 }
 
+// Generate the pawns only hash key from scratch:
+U64 generate_pawn_key(position *pos)
+{
+	// Start from the pawn key base:
+	U64 final_key = pawn_base_key;
+	// Loop over white and black pawns:
+	for (int piece = P; piece <= p; piece += p - P)
+	{
+		U64 bitboard = pos->bitboards[piece];
+		while (bitboard)
+		{
+			int square = get_ls1b_index(bitboard);
+			final_key ^= piece_keys[piece][square];
+			pop_bit(bitboard, square);
+		}
+	}
+	// Return the generated pawn key:
+	return final_key;
+}
+
+// Hash a pawn in or out of the pawn key:
+#define hash_pawn(pos, piece, square)               \
+	do                                                \
+	{                                                 \
+		if ((piece) == P || (piece) == p)               \
+			(pos)->pawn_key ^= piece_keys[piece][square]; \
+	} while (0)
+
+/*
+	Material and piece-square scores only change with the pieces that move, so
+	make_move keeps their sum (and the game phase score) in the position the same
+	way it keeps the hash key, and evaluate only adds the pawn structure, mobility
+	and king safety terms on top.
+*/
+
+// Material + piece-square scores [opening/endgame][piece][square] (negative for black pieces):
+int piece_square_scores[2][12][64];
+
+// Game phase score of each piece (0 for pawns and kings):
+int phase_values[12];
+
+// Add a piece on a square to the incremental scores:
+#define add_piece_score(pos, piece, square)                         \
+	(pos)->piece_square[0] += piece_square_scores[0][piece][square], \
+	(pos)->piece_square[1] += piece_square_scores[1][piece][square], \
+	(pos)->phase_score += phase_values[piece]
+
+// Remove a piece on a square from the incremental scores:
+#define remove_piece_score(pos, piece, square)                      \
+	(pos)->piece_square[0] -= piece_square_scores[0][piece][square], \
+	(pos)->piece_square[1] -= piece_square_scores[1][piece][square], \
+	(pos)->phase_score -= phase_values[piece]
+
+// Compute the incremental scores from scratch:
+void generate_piece_square_scores(position *pos)
+{
+	// Reset the scores:
+	pos->piece_square[0] = pos->piece_square[1] = pos->phase_score = 0;
+	// Loop over pieces bitboards:
+	for (int piece = P; piece <= k; piece++)
+	{
+		// Loop over the pieces within a bitboard:
+		U64 bitboard = pos->bitboards[piece];
+		while (bitboard)
+		{
+			int square = get_ls1b_index(bitboard);
+			add_piece_score(pos, piece, square);
+			pop_bit(bitboard, square);
+		}
+	}
+}
+
+/******************************************************************************\
+===================================== NNUE =====================================
+\******************************************************************************/
+
+/*
+	The optional NNUE evaluation uses a (768 -> 256)x2 -> 1 network: one input
+	per piece type, color and square, seen from each side's perspective ("us"
+	pieces first, board flipped for black). The first layer output for both
+	perspectives (the accumulators) lives in the position and make_move adds
+	and subtracts only the weight rows of the pieces that moved. The output
+	layer clips the accumulators to [0, QA] (CReLU) and dots them with the
+	output weights, side to move half first.
+
+	Network file (little endian int16, the usual "simple" trainer layout, may be
+	padded to 64 bytes):
+
+		feature weights   [768][256]   (quantized by QA)
+		feature biases    [256]        (quantized by QA)
+		output weights    [2][256]     (quantized by QB)
+		output bias                    (quantized by QA * QB)
+
+	The file is mapped read only (EvalFile option) and the handcrafted
+	evaluation stays in use until a network is loaded (UseNNUE option).
+*/
+
+// Network quantization and output scale:
+#define nnue_qa 255
+#define nnue_qb 64
+#define nnue_scale 400
+
+// Number of input features (12 pieces * 64 squares):
+#define nnue_inputs 768
+
+// Keep network scores clear of the mate scores:
+#define nnue_max_eval 20000
+
+// Loaded network (weights point into the mapped file):
+typedef struct
+{
+	const short *feature_weights;
+	const short *feature_biases;
+	const short *output_weights;
+	int output_bias;
+	// File mapping:
+	void *data;
+	U64 size;
+} nnue_network;
+
+// Network in use (no network loaded when data is NULL):
+nnue_network network;
+
+// Evaluate with the network (switched by the UseNNUE option):
+int use_nnue = 0;
+
+// Feature index of a piece on a square from the white [0] and black [1] perspectives:
+int nnue_feature[2][12][64];
+
+// Initialize feature indices:
+void init_nnue_features()
+{
+	// Loop over pieces and squares:
+	for (int piece = P; piece <= k; piece++)
+	{
+		for (int square = 0; square < 64; square++)
+		{
+			// White perspective (square 0 is a1 for the network):
+			nnue_feature[white][piece][square] = piece * 64 + (square ^ 56);
+			// Black perspective (colors swapped, board flipped):
+			nnue_feature[black][piece][square] = ((piece + 6) % 12) * 64 + square;
+		}
+	}
+}
+
+// Weights row of a feature:
+#define nnue_row(feature) (network.feature_weights + (feature) * nnue_hidden)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// Add and subtract weight rows to an accumulator (AVX2):
+__attribute__((target("avx2"))) void nnue_update_avx2(short *accumulator, const short **added, int adds, const short **removed, int removes)
+{
+	for (int index = 0; index < nnue_hidden; index += 16)
+	{
+		__m256i sum = _mm256_loadu_si256((__m256i *)(accumulator + index));
+		for (int feature = 0; feature < adds; feature++)
+			sum = _mm256_add_epi16(sum, _mm256_loadu_si256((__m256i *)(added[feature] + index)));
+		for (int feature = 0; feature < removes; feature++)
+			sum = _mm256_sub_epi16(sum, _mm256_loadu_si256((__m256i *)(removed[feature] + index)));
+		_mm256_storeu_si256((__m256i *)(accumulator + index), sum);
+	}
+}
+
+// Clipped accumulators dot output weights (AVX2):
+__attribute__((target("avx2"))) int nnue_output_avx2(const short *us, const short *them, const short *weights)
+{
+	__m256i zero = _mm256_setzero_si256(), qa = _mm256_set1_epi16(nnue_qa), sum = _mm256_setzero_si256();
+	for (int index = 0; index < nnue_hidden; index += 16)
+	{
+		__m256i us_clipped = _mm256_min_epi16(_mm256_max_epi16(_mm256_loadu_si256((__m256i *)(us + index)), zero), qa);
+		__m256i them_clipped = _mm256_min_epi16(_mm256_max_epi16(_mm256_loadu_si256((__m256i *)(them + index)), zero), qa);
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(us_clipped, _mm256_loadu_si256((__m256i *)(weights + index))));
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(them_clipped, _mm256_loadu_si256((__m256i *)(weights + nnue_hidden + index))));
+	}
+	// Horizontal sum:
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+	return _mm_cvtsi128_si32(half);
+}
+
+// Add and subtract weight rows to an accumulator (SSE4.1):
+__attribute__((target("sse4.1"))) void nnue_update_sse4(short *accumulator, const short **added, int adds, const short **removed, int removes)
+{
+	for (int index = 0; index < nnue_hidden; index += 8)
+	{
+		__m128i sum = _mm_loadu_si128((__m128i *)(accumulator + index));
+		for (int feature = 0; feature < adds; feature++)
+			sum = _mm_add_epi16(sum, _mm_loadu_si128((__m128i *)(added[feature] + index)));
+		for (int feature = 0; feature < removes; feature++)
+			sum = _mm_sub_epi16(sum, _mm_loadu_si128((__m128i *)(removed[feature] + index)));
+		_mm_storeu_si128((__m128i *)(accumulator + index), sum);
+	}
+}
+
+// Clipped accumulators dot output weights (SSE4.1):
+__attribute__((target("sse4.1"))) int nnue_output_sse4(const short *us, const short *them, const short *weights)
+{
+	__m128i zero = _mm_setzero_si128(), qa = _mm_set1_epi16(nnue_qa), sum = _mm_setzero_si128();
+	for (int index = 0; index < nnue_hidden; index += 8)
+	{
+		__m128i us_clipped = _mm_min_epi16(_mm_max_epi16(_mm_loadu_si128((__m128i *)(us + index)), zero), qa);
+		__m128i them_clipped = _mm_min_epi16(_mm_max_epi16(_mm_loadu_si128((__m128i *)(them + index)), zero), qa);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(us_clipped, _mm_loadu_si128((__m128i *)(weights + index))));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(them_clipped, _mm_loadu_si128((__m128i *)(weights + nnue_hidden + index))));
+	}
+	// Horizontal sum:
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+	return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+// Add and subtract weight rows to an accumulator (portable):
+void nnue_update_scalar(short *accumulator, const short **added, int adds, const short **removed, int removes)
+{
+	for (int index = 0; index < nnue_hidden; index++)
+	{
+		int sum = accumulator[index];
+		for (int feature = 0; feature < adds; feature++)
+			sum += added[feature][index];
+		for (int feature = 0; feature < removes; feature++)
+			sum -= removed[feature][index];
+		accumulator[index] = (short)sum;
+	}
+}
+
+// Clipped accumulators dot output weights (portable):
+int nnue_output_scalar(const short *us, const short *them, const short *weights)
+{
+	int sum = 0;
+	for (int index = 0; index < nnue_hidden; index++)
+	{
+		int us_clipped = (us[index] < 0) ? 0 : (us[index] > nnue_qa) ? nnue_qa : us[index];
+		int them_clipped = (them[index] < 0) ? 0 : (them[index] > nnue_qa) ? nnue_qa : them[index];
+		sum += us_clipped * weights[index] + them_clipped * weights[nnue_hidden + index];
+	}
+	return sum;
+}
+
+// Add and subtract weight rows to an accumulator (best backend):
+static inline void nnue_update(short *accumulator, const short **added, int adds, const short **removed, int removes)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (hardware_avx2)
+		nnue_update_avx2(accumulator, added, adds, removed, removes);
+	else if (hardware_sse41)
+		nnue_update_sse4(accumulator, added, adds, removed, removes);
+	else
+#endif
+		nnue_update_scalar(accumulator, added, adds, removed, removes);
+}
+
+// Clipped accumulators dot output weights (best backend):
+static inline int nnue_output(const short *us, const short *them, const short *weights)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (hardware_avx2)
+		return nnue_output_avx2(us, them, weights);
+	if (hardware_sse41)
+		return nnue_output_sse4(us, them, weights);
+#endif
+	return nnue_output_scalar(us, them, weights);
+}
+
+// Compute both accumulators from scratch:
+void refresh_accumulators(position *pos)
+{
+	// No network loaded:
+	if (network.data == NULL)
+		return;
+	// Loop over perspectives:
+	for (int perspective = white; perspective <= black; perspective++)
+	{
+		// Start from the biases:
+		memcpy(pos->accumulator[perspective], network.feature_biases, sizeof(pos->accumulator[perspective]));
+		// Add every piece on the board:
+		for (int piece = P; piece <= k; piece++)
+		{
+			U64 bitboard = pos->bitboards[piece];
+			while (bitboard)
+			{
+				int square = get_ls1b_index(bitboard);
+				const short *row = nnue_row(nnue_feature[perspective][piece][square]);
+				nnue_update(pos->accumulator[perspective], &row, 1, NULL, 0);
+				pop_bit(bitboard, square);
+			}
+		}
+	}
+}
+
+// Update both accumulators with the pieces a move added and removed:
+static inline void update_accumulators(position *pos, const int *added, int adds, const int *removed, int removes)
+{
+	// Weight rows of the changed features:
+	const short *added_rows[2], *removed_rows[2];
+	// Loop over perspectives:
+	for (int perspective = white; perspective <= black; perspective++)
+	{
+		// Pieces are packed as piece * 64 + square:
+		for (int index = 0; index < adds; index++)
+			added_rows[index] = nnue_row(nnue_feature[perspective][added[index] >> 6][added[index] & 63]);
+		for (int index = 0; index < removes; index++)
+			removed_rows[index] = nnue_row(nnue_feature[perspective][removed[index] >> 6][removed[index] & 63]);
+		nnue_update(pos->accumulator[perspective], added_rows, adds, removed_rows, removes);
+	}
+}
+
+// Name of the NNUE kernels in use:
+char *nnue_backend_name()
+{
+	return hardware_avx2 ? "avx2" : hardware_sse41 ? "sse4.1" : "scalar";
+}
+
+// Evaluate the position with the network (side to move point of view):
+static inline int evaluate_nnue(position *pos)
+{
+	// Output layer:
+	int output = nnue_output(pos->accumulator[pos->side], pos->accumulator[pos->side ^ 1], network.output_weights);
+	// Scale to centipawns:
+	int score = (int)(((long long)output + network.output_bias) * nnue_scale / (nnue_qa * nnue_qb));
+	// Keep clear of the mate scores:
+	return (score > nnue_max_eval) ? nnue_max_eval : (score < -nnue_max_eval) ? -nnue_max_eval : score;
+}
+
+// Unload the network (back to the handcrafted evaluation):
+void free_network()
+{
+	// Nothing loaded:
+	if (network.data == NULL)
+		return;
+#ifdef WIN64
+	free(network.data);
+#else
+	munmap(network.data, network.size);
+#endif
+	memset(&network, 0, sizeof(network));
+	use_nnue = 0;
+}
+
+// Load a network file (returns 1 on success and switches NNUE on):
+int load_network(char *path)
+{
+	// Expected file size (int16 values):
+	U64 expected = ((U64)nnue_inputs * nnue_hidden + nnue_hidden + 2 * nnue_hidden + 1) * sizeof(short);
+	// File data and size:
+	void *data = NULL;
+	U64 size = 0;
+#ifdef WIN64
+	// Read the whole file:
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return 0;
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = malloc(size ? size : 1);
+	if (data == NULL || fread(data, 1, size, file) != size)
+	{
+		free(data);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+#else
+	// Map the file read only:
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor < 0)
+		return 0;
+	struct stat file_stat;
+	if (fstat(descriptor, &file_stat) < 0 || file_stat.st_size <= 0)
+	{
+		close(descriptor);
+		return 0;
+	}
+	size = file_stat.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	close(descriptor);
+	if (data == MAP_FAILED)
+		return 0;
+#endif
+	// Reject files of another network shape (trainers pad to 64 bytes):
+	if (size < expected || size >= expected + 64)
+	{
+#ifdef WIN64
+		free(data);
+#else
+		munmap(data, size);
+#endif
+		return 0;
+	}
+	// Replace the previous network:
+	free_network();
+	network.data = data;
+	network.size = size;
+	network.feature_weights = (const short *)data;
+	network.feature_biases = network.feature_weights + nnue_inputs * nnue_hidden;
+	network.output_weights = network.feature_biases + nnue_hidden;
+	network.output_bias = network.output_weights[2 * nnue_hidden];
+	// Switch the network on:
+	use_nnue = 1;
+	return 1;
+}
+
 /******************************************************************************\
 ============================== INPUT AND OUTPUT ================================
 \******************************************************************************/
@@ -657,16 +1292,16 @@ void print_bitboard(U64 bitboard)
 }
 
 // Print board:
-void print_board()
+void print_board(position *pos)
 {
 	// Print horizontal top border:
 	printf("\n");
 	printf("\033[0;30m+---------------------------------------+\n");
-	if (side == white)
+	if (pos->side == white)
 	{
 		printf("|            \033[0;33m=> WHITE TURN <=\033[0;30m           |\n");
 	}
-	else if (side == black)
+	else if (pos->side == black)
 	{
 		printf("|            \033[0;34m=> BLACK TURN <=\033[0;30m           |\n");
 	}
@@ -676,9 +1311,9 @@ void print_board()
 	}
 	// Print top horizontal separador:
 	printf("|   +-");
-	(castle & bq) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
+	(pos->castle & bq) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
 	printf("-+---+---+---+---+---+---+-");
-	(castle & bk) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
+	(pos->castle & bk) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
 	printf("-+   |\n");
 	// Loop over board ranks:
 	for (int rank = 0; rank < 8; rank++)
@@ -689,11 +1324,11 @@ void print_board()
 			printf("|   ");
 			for (int file = 0; file < 8; file++)
 			{
-				if (enpassant != no_sq && (enpassant == ((rank * 8) + file) || enpassant == (((rank - 1) * 8) + file)))
+				if (pos->enpassant != no_sq && (pos->enpassant == ((rank * 8) + file) || pos->enpassant == (((rank - 1) * 8) + file)))
 				{
 					printf("\033[0;31m+---");
 				}
-				else if (enpassant != no_sq && ((enpassant + 1 == ((rank * 8) + file) && ((enpassant + 1) % 8 > 0)) || (enpassant + 1 == (((rank - 1) * 8) + file) && ((enpassant + 1) % 8 > 0))))
+				else if (pos->enpassant != no_sq && ((pos->enpassant + 1 == ((rank * 8) + file) && ((pos->enpassant + 1) % 8 > 0)) || (pos->enpassant + 1 == (((rank - 1) * 8) + file) && ((pos->enpassant + 1) % 8 > 0))))
 				{
 					printf("\033[0;31m+\033[0;30m---");
 				}
@@ -714,23 +1349,15 @@ void print_board()
 			char square_empty = (square + rank) % 2 == 0 ? ' ' : ':';
 			int piece_color = white;
 			// Defining the piece to print:
-			int piece = -1;
-			// Loop over all 12 pieces bitboards:
-			for (int bb_piece = P; bb_piece <= k; bb_piece++)
+			int piece = (pos->board[square] != no_piece) ? pos->board[square] : -1;
+			if (piece >= p)
 			{
-				if (get_bit(bitboards[bb_piece], square))
-				{
-					piece = bb_piece;
-					if (bb_piece >= p)
-					{
-						piece_color = black;
-					}
-				}
+				piece_color = black;
 			}
 			// Print rank label:
 			if (!file)
 			{
-				if (enpassant % 8 == 0 && square == enpassant)
+				if (pos->enpassant % 8 == 0 && square == pos->enpassant)
 				{
 					printf("| \e[0m%1d\033[0;31m |\033[0;30m", 8 - rank);
 				}
@@ -759,7 +1386,7 @@ void print_board()
 				piece != -1 ? printf("%c\033[0;34m%s\033[0;30m%c", square_color, unicode_pieces[piece], square_color) : printf("%c%c%c\033[0;30m", square_color, square_empty, square_color);
 			}
 #endif
-			if (enpassant != no_sq && (enpassant == (square) || (enpassant == (square + 1) && (square + 1) % 8 != 0)))
+			if (pos->enpassant != no_sq && (pos->enpassant == (square) || (pos->enpassant == (square + 1) && (square + 1) % 8 != 0)))
 			{
 				printf("\033[0;31m|\033[0;30m");
 			}
@@ -775,31 +1402,34 @@ void print_board()
 	}
 	// Print horizontal bottom border:
 	printf("|   +-");
-	(castle & wq) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
+	(pos->castle & wq) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
 	printf("-+---+---+---+---+---+---+-");
-	(castle & wk) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
+	(pos->castle & wk) ? printf("\033[0;32m%c\033[0;30m", '@') : printf("%c", '-');
 	printf("-+   |\n");
 	printf("|     \e[0ma   b   c   d   e   f   g   h\033[0;30m     |\n");
 	printf("+---------------------------------------+\n");
 	// Print the hash key:
-	printf("| \033[0;33mHash key: \033[0;32m%27llx \033[0;30m|\n", hash_key);
+	printf("| \033[0;33mHash key: \033[0;32m%27llx \033[0;30m|\n", pos->hash_key);
 	printf("+---------------------------------------+\e[0m\n\n");
 }
 
 // Parse FEN string:
-void parse_fen(char *fen)
+void parse_fen(position *pos, char *fen)
 {
 	// Reset board positions:
-	memset(bitboards, 0ULL, sizeof(bitboards));
-	memset(occupancies, 0ULL, sizeof(occupancies));
+	memset(pos->bitboards, 0ULL, sizeof(pos->bitboards));
+	memset(pos->occupancies, 0ULL, sizeof(pos->occupancies));
+	// Reset the mailbox:
+	for (int square = 0; square < 64; square++)
+		pos->board[square] = no_piece;
 	// Reset board states:
-	side = 0;
-	enpassant = no_sq;
-	castle = 0;
+	pos->side = 0;
+	pos->enpassant = no_sq;
+	pos->castle = 0;
 	// Reset repetition index:
-	repetition_index = 0;
+	pos->repetition_index = 0;
 	// Reset the repetition table:
-	memset(repetition_table, 0ULL, sizeof(repetition_table));
+	memset(pos->repetition_table, 0ULL, sizeof(pos->repetition_table));
 	// Loop over board ranks:
 	for (int rank = 0; rank < 8; rank++)
 	{
@@ -814,7 +1444,9 @@ void parse_fen(char *fen)
 				// Initialize piece type:
 				int piece = char_pieces[*fen];
 				// Set piece on corresponding bitboard:
-				set_bit(bitboards[piece], square);
+				set_bit(pos->bitboards[piece], square);
+				// Set piece in the mailbox:
+				pos->board[square] = piece;
 				// Increment pointer to FEN string:
 				fen++;
 			}
@@ -824,20 +1456,8 @@ void parse_fen(char *fen)
 				// Initialize offset (convert char '0' to int 0):
 				int offset = *fen - '0';
 
-				// Define piece variable:
-				int piece = -1;
-				// Loop over all pieces bitboards:
-				for (int bb_piece = P; bb_piece <= k; bb_piece++)
-				{
-					// If there is a piece on current square:
-					if (get_bit(bitboards[bb_piece], square))
-					{
-						// Get piece code:
-						piece = bb_piece;
-					}
-				}
 				// On empty current square:
-				if (piece == -1)
+				if (pos->board[square] == no_piece)
 				{
 					// Decrement file:
 					file--;
@@ -858,7 +1478,7 @@ void parse_fen(char *fen)
 	// Increment pointer to FEN string to go direct to side to move:
 	fen++;
 	// Parse side to move:
-	(*fen == 'w') ? (side = white) : (side = black);
+	(*fen == 'w') ? (pos->side = white) : (pos->side = black);
 	// Increment pointer to FEN string to go direct to castling rights:
 	fen += 2;
 	// Parse castling rights:
@@ -868,16 +1488,16 @@ void parse_fen(char *fen)
 		switch (*fen)
 		{
 		case 'K':
-			castle |= wk;
+			pos->castle |= wk;
 			break;
 		case 'Q':
-			castle |= wq;
+			pos->castle |= wq;
 			break;
 		case 'k':
-			castle |= bk;
+			pos->castle |= bk;
 			break;
 		case 'q':
-			castle |= bq;
+			pos->castle |= bq;
 			break;
 		case '-':
 			break;
@@ -894,30 +1514,35 @@ void parse_fen(char *fen)
 		int file = fen[0] - 'a';
 		int rank = 8 - (fen[1] - '0');
 		// Initialize enpassant square:
-		enpassant = rank * 8 + file;
+		pos->enpassant = rank * 8 + file;
 	}
 	// No enpassant square:
 	else
 	{
-		enpassant = no_sq;
+		pos->enpassant = no_sq;
 	}
 	// Initialize white occupancies:
 	for (int piece = P; piece <= K; piece++)
 	{
 		// Populate white occupancy bitboard:
-		occupancies[white] |= bitboards[piece];
+		pos->occupancies[white] |= pos->bitboards[piece];
 	}
 	// Initialize black occupancies:
 	for (int piece = p; piece <= k; piece++)
 	{
 		// Populate black occupancy bitboard:
-		occupancies[black] |= bitboards[piece];
+		pos->occupancies[black] |= pos->bitboards[piece];
 	}
 	// Populate both occupancy bitboard:
-	occupancies[both] |= occupancies[white];
-	occupancies[both] |= occupancies[black];
+	pos->occupancies[both] |= pos->occupancies[white];
+	pos->occupancies[both] |= pos->occupancies[black];
 	// Initialize hash key:
-	hash_key = generate_hash_key();
+	pos->hash_key = generate_hash_key(pos);
+	pos->pawn_key = generate_pawn_key(pos);
+	// Initialize material, piece-square and game phase scores:
+	generate_piece_square_scores(pos);
+	// Initialize NNUE accumulators:
+	refresh_accumulators(pos);
 }
 
 /******************************************************************************\
@@ -1111,13 +1736,51 @@ U64 king_attacks[64];
 U64 bishop_masks[64];
 
 // Bishop attacks table [square][occupancies]
-U64 bishop_attacks[64][512];
+U64 (*bishop_attacks)[512];
 
 // Rook attacks masks:
 U64 rook_masks[64];
 
 // Rook attacks table [square][occupancies]
-U64 rook_attacks[64][4096];
+U64 (*rook_attacks)[4096];
+
+/*
+	The magic tables above are sized for the worst square, so most of their
+	entries are padding. With BMI2 the occupancy index is simply the PEXT of
+	the occupancy by the attack mask, which lets every square use exactly
+	2^relevant_bits entries of one densely packed table.
+*/
+
+// Bishop PEXT attacks table (all squares packed) and per square offsets:
+U64 *bishop_pext_attacks;
+int bishop_pext_offsets[64];
+
+// Rook PEXT attacks table (all squares packed) and per square offsets:
+U64 *rook_pext_attacks;
+int rook_pext_offsets[64];
+
+// Slider attack tables size (in U64 entries), memory and page mode:
+#define slider_tables_size (64 * 4096 + 64 * 512 + 102400 + 5248)
+U64 *slider_tables = NULL;
+int slider_page_mode = plain_pages;
+
+// Allocate the slider attack tables in one block (3MB, on huge pages when possible):
+void init_slider_tables()
+{
+	// Allocate the block:
+	slider_tables = large_page_alloc(slider_tables_size * sizeof(U64), &slider_page_mode);
+	// The engine can't run without attack tables:
+	if (slider_tables == NULL)
+	{
+		printf("Failed to allocate the slider attack tables\n");
+		exit(1);
+	}
+	// Split it between the tables (the biggest first):
+	rook_attacks = (U64(*)[4096])slider_tables;
+	bishop_attacks = (U64(*)[512])(slider_tables + 64 * 4096);
+	rook_pext_attacks = slider_tables + 64 * 4096 + 64 * 512;
+	bishop_pext_attacks = rook_pext_attacks + 102400;
+}
 
 // Generate pawns attacks:
 U64 mask_pawn_attacks(int side, int square)
@@ -1350,20 +2013,59 @@ void init_leapers_attacks()
 	}
 }
 
-// Set occupancies:
-U64 set_occupancy(int index, int bits_in_mask, U64 attack_mask)
+// Squares strictly between two aligned squares [square][square]:
+U64 between_masks[64][64];
+
+// Whole line through two aligned squares [square][square]:
+U64 line_masks[64][64];
+
+// Initialize between and line masks (used for pins and check evasions):
+void init_line_masks()
 {
-	// Occupancy map:
-	U64 occupancy = 0ULL;
-	// Loop over the range of bits within attack mask:
-	for (int count = 0; count < bits_in_mask; count++)
+	// Loop over source squares:
+	for (int source_square = 0; source_square < 64; source_square++)
 	{
-		// Get LS1B index of attack mask:
-		int square = get_ls1b_index(attack_mask);
-		// Pop LS1B in attack mask:
-		pop_bit(attack_mask, square);
-		// Make sure that ocuupancy is on board:
-		if (index & (1 << count))
+		// Loop over target squares:
+		for (int target_square = 0; target_square < 64; target_square++)
+		{
+			// Squares as bitboards:
+			U64 source_bit = 1ULL << source_square, target_bit = 1ULL << target_square;
+			// Squares on the same rank or file:
+			if (source_square != target_square && (rook_attacks_on_the_fly(source_square, 0ULL) & target_bit))
+			{
+				between_masks[source_square][target_square] = rook_attacks_on_the_fly(source_square, target_bit) & rook_attacks_on_the_fly(target_square, source_bit);
+				line_masks[source_square][target_square] = (rook_attacks_on_the_fly(source_square, 0ULL) & rook_attacks_on_the_fly(target_square, 0ULL)) | source_bit | target_bit;
+			}
+			// Squares on the same diagonal:
+			else if (source_square != target_square && (bishop_attacks_on_the_fly(source_square, 0ULL) & target_bit))
+			{
+				between_masks[source_square][target_square] = bishop_attacks_on_the_fly(source_square, target_bit) & bishop_attacks_on_the_fly(target_square, source_bit);
+				line_masks[source_square][target_square] = (bishop_attacks_on_the_fly(source_square, 0ULL) & bishop_attacks_on_the_fly(target_square, 0ULL)) | source_bit | target_bit;
+			}
+			// Squares not aligned:
+			else
+			{
+				between_masks[source_square][target_square] = 0ULL;
+				line_masks[source_square][target_square] = 0ULL;
+			}
+		}
+	}
+}
+
+// Set occupancies:
+U64 set_occupancy(int index, int bits_in_mask, U64 attack_mask)
+{
+	// Occupancy map:
+	U64 occupancy = 0ULL;
+	// Loop over the range of bits within attack mask:
+	for (int count = 0; count < bits_in_mask; count++)
+	{
+		// Get LS1B index of attack mask:
+		int square = get_ls1b_index(attack_mask);
+		// Pop LS1B in attack mask:
+		pop_bit(attack_mask, square);
+		// Make sure that ocuupancy is on board:
+		if (index & (1 << count))
 			// Populare occupancy map:
 			occupancy |= (1ULL << square);
 	}
@@ -1466,6 +2168,8 @@ void print_magic_numbers()
 // Initialize slider pieces attack tables:
 void init_sliders_attacks(int bishop)
 {
+	// Next free entry of the dense PEXT table:
+	int pext_offset = 0;
 	// Loop over 64 board squares:
 	for (int square = 0; square < 64; square++)
 	{
@@ -1478,6 +2182,12 @@ void init_sliders_attacks(int bishop)
 		int relevant_bits_count = count_bits(attack_mask);
 		// Initialize occupancy indicies:
 		int ocuupancy_indicies = (1 << relevant_bits_count);
+		// Reserve this square's slice of the dense PEXT table:
+		if (bishop)
+			bishop_pext_offsets[square] = pext_offset;
+		else
+			rook_pext_offsets[square] = pext_offset;
+		pext_offset += ocuupancy_indicies;
 		// Loop over occupancy indicies:
 		for (int index = 0; index < ocuupancy_indicies; index++)
 		{
@@ -1490,6 +2200,8 @@ void init_sliders_attacks(int bishop)
 				int magic_index = (occupancy * bishop_magic_numbers[square]) >> (64 - bishop_relevant_bits[square]);
 				// Initialize bishop attacks:
 				bishop_attacks[square][magic_index] = bishop_attacks_on_the_fly(square, occupancy);
+				// Initialize bishop PEXT attacks (the PEXT of the occupancy is the index itself):
+				bishop_pext_attacks[bishop_pext_offsets[square] + index] = bishop_attacks[square][magic_index];
 			}
 			// Rook
 			else
@@ -1500,6 +2212,8 @@ void init_sliders_attacks(int bishop)
 				int magic_index = (occupancy * rook_magic_numbers[square]) >> (64 - rook_relevant_bits[square]);
 				// Initialize rook attacks:
 				rook_attacks[square][magic_index] = rook_attacks_on_the_fly(square, occupancy);
+				// Initialize rook PEXT attacks (the PEXT of the occupancy is the index itself):
+				rook_pext_attacks[rook_pext_offsets[square] + index] = rook_attacks[square][magic_index];
 			}
 		}
 	}
@@ -1508,6 +2222,9 @@ void init_sliders_attacks(int bishop)
 // Get bishop attacks:
 static inline U64 get_bishop_attacks(int square, U64 occupancy)
 {
+	// Use the dense PEXT table on BMI2 hardware:
+	if (hardware_pext)
+		return bishop_pext_attacks[bishop_pext_offsets[square] + pext(occupancy, bishop_masks[square])];
 	// Get bishop attacks assuming current board occupancy:
 	occupancy &= bishop_masks[square];
 	occupancy *= bishop_magic_numbers[square];
@@ -1519,6 +2236,9 @@ static inline U64 get_bishop_attacks(int square, U64 occupancy)
 // Get rook attacks:
 static inline U64 get_rook_attacks(int square, U64 occupancy)
 {
+	// Use the dense PEXT table on BMI2 hardware:
+	if (hardware_pext)
+		return rook_pext_attacks[rook_pext_offsets[square] + pext(occupancy, rook_masks[square])];
 	// Get rook attacks assuming current board occupancy:
 	occupancy &= rook_masks[square];
 	occupancy *= rook_magic_numbers[square];
@@ -1530,6 +2250,9 @@ static inline U64 get_rook_attacks(int square, U64 occupancy)
 // Get queen attacks:
 static inline U64 get_queen_attacks(int square, U64 occupancy)
 {
+	// Use the dense PEXT tables on BMI2 hardware:
+	if (hardware_pext)
+		return get_bishop_attacks(square, occupancy) | get_rook_attacks(square, occupancy);
 	// Initialize result attacks bitboard:
 	U64 queen_attacks = 0ULL;
 	// Initialize bishop occupancies:
@@ -1557,35 +2280,51 @@ static inline U64 get_queen_attacks(int square, U64 occupancy)
 \******************************************************************************/
 
 // Is a current given square being attacked by a current given side:
-static inline int is_square_attacked(int square, int side)
+static inline int is_square_attacked(position *pos, int square, int side)
 {
 	// Attacked by white pawns:
-	if ((side == white) && (pawn_attacks[black][square] & bitboards[P]))
+	if ((side == white) && (pawn_attacks[black][square] & pos->bitboards[P]))
 		return 1;
 	// Attacked by black pawns:
-	if ((side == black) && (pawn_attacks[white][square] & bitboards[p]))
+	if ((side == black) && (pawn_attacks[white][square] & pos->bitboards[p]))
 		return 1;
 	// Attacked by knights:
-	if (knight_attacks[square] & ((side == white) ? bitboards[N] : bitboards[n]))
+	if (knight_attacks[square] & ((side == white) ? pos->bitboards[N] : pos->bitboards[n]))
 		return 1;
 	// Attacked by bishops:
-	if (get_bishop_attacks(square, occupancies[both]) & ((side == white) ? bitboards[B] : bitboards[b]))
+	if (get_bishop_attacks(square, pos->occupancies[both]) & ((side == white) ? pos->bitboards[B] : pos->bitboards[b]))
 		return 1;
 	// Attacked by rooks:
-	if (get_rook_attacks(square, occupancies[both]) & ((side == white) ? bitboards[R] : bitboards[r]))
+	if (get_rook_attacks(square, pos->occupancies[both]) & ((side == white) ? pos->bitboards[R] : pos->bitboards[r]))
 		return 1;
 	// Attacked by queens:
-	if (get_queen_attacks(square, occupancies[both]) & ((side == white) ? bitboards[Q] : bitboards[q]))
+	if (get_queen_attacks(square, pos->occupancies[both]) & ((side == white) ? pos->bitboards[Q] : pos->bitboards[q]))
 		return 1;
 	// Attacked by kings:
-	if (king_attacks[square] & ((side == white) ? bitboards[K] : bitboards[k]))
+	if (king_attacks[square] & ((side == white) ? pos->bitboards[K] : pos->bitboards[k]))
 		return 1;
 	// By default return false:
 	return 0;
 }
 
+// Get the pieces of both sides attacking a square through a given occupancy:
+static inline U64 get_attackers(position *pos, int square, U64 occupancy)
+{
+	// Diagonal and straight sliders:
+	U64 bishops_queens = pos->bitboards[B] | pos->bitboards[b] | pos->bitboards[Q] | pos->bitboards[q];
+	U64 rooks_queens = pos->bitboards[R] | pos->bitboards[r] | pos->bitboards[Q] | pos->bitboards[q];
+	// Return every piece attacking the square:
+	return ((pawn_attacks[black][square] & pos->bitboards[P]) |
+					(pawn_attacks[white][square] & pos->bitboards[p]) |
+					(knight_attacks[square] & (pos->bitboards[N] | pos->bitboards[n])) |
+					(king_attacks[square] & (pos->bitboards[K] | pos->bitboards[k])) |
+					(get_bishop_attacks(square, occupancy) & bishops_queens) |
+					(get_rook_attacks(square, occupancy) & rooks_queens)) &
+				 occupancy;
+}
+
 // Print attacked squares:
-void print_attacked_squares(int side)
+void print_attacked_squares(position *pos, int side)
 {
 	// Print horizontal top border:
 	printf("\n");
@@ -1612,7 +2351,7 @@ void print_attacked_squares(int side)
 			if (!file)
 				printf("| \e[0m%1d\033[0;30m |", 8 - rank);
 			// Check wheter current square is attacked or not:
-			is_square_attacked(square, side) ? printf(" \033[0;31m%s\033[0;30m |", "⚔") : printf(" %d\033[0;30m |", 0);
+			is_square_attacked(pos, square, side) ? printf(" \033[0;31m%s\033[0;30m |", "⚔") : printf(" %d\033[0;30m |", 0);
 			if (file == 7)
 				printf("   |");
 		}
@@ -1644,14 +2383,14 @@ void print_attacked_squares(int side)
 
 // Encode move:
 #define encode_move(source, target, piece, promoted, capture, double, enpassant, castling) \
-	(source) |                                                                               \
-			(target << 6) |                                                                      \
-			(piece << 12) |                                                                      \
-			(promoted << 16) |                                                                   \
-			(capture << 20) |                                                                    \
-			(double << 21) |                                                                     \
-			(enpassant << 22) |                                                                  \
-			(castling << 23)
+	((source) |                                                                              \
+			((target) << 6) |                                                                     \
+			((piece) << 12) |                                                                     \
+			((promoted) << 16) |                                                                  \
+			((capture) << 20) |                                                                   \
+			((double) << 21) |                                                                    \
+			((enpassant) << 22) |                                                                 \
+			((castling) << 23))
 
 // Extract move properties:
 #define get_move_source(move) (move & 0x3f)
@@ -1735,28 +2474,53 @@ void print_move_list(moves *move_list)
 }
 
 // Preserve board state:
-#define copy_board()                                                  \
-	U64 bitboards_copy[12], occupancies_copy[3];                        \
-	int side_copy, enpassant_copy, castle_copy;                         \
-	memcpy(bitboards_copy, bitboards, 96);                              \
-	memcpy(occupancies_copy, occupancies, 24);                          \
-	side_copy = side, enpassant_copy = enpassant, castle_copy = castle; \
-	U64 hash_key_copy = hash_key;
+#define copy_board(pos)                                                                  \
+	U64 bitboards_copy[12], occupancies_copy[3];                                           \
+	int side_copy, enpassant_copy, castle_copy;                                            \
+	memcpy(bitboards_copy, (pos)->bitboards, 96);                                          \
+	memcpy(occupancies_copy, (pos)->occupancies, 24);                                      \
+	int board_copy[64];                                                                    \
+	memcpy(board_copy, (pos)->board, sizeof(board_copy));                                  \
+	side_copy = (pos)->side, enpassant_copy = (pos)->enpassant, castle_copy = (pos)->castle; \
+	U64 hash_key_copy = (pos)->hash_key, pawn_key_copy = (pos)->pawn_key;                  \
+	int piece_square_copy[2] = {(pos)->piece_square[0], (pos)->piece_square[1]};           \
+	int phase_score_copy = (pos)->phase_score;
 
 // Restore board state:
-#define restore_board()                                               \
-	memcpy(bitboards, bitboards_copy, 96);                              \
-	memcpy(occupancies, occupancies_copy, 24);                          \
-	side = side_copy, enpassant = enpassant_copy, castle = castle_copy; \
-	hash_key = hash_key_copy;
+#define restore_board(pos)                                                               \
+	memcpy((pos)->bitboards, bitboards_copy, 96);                                          \
+	memcpy((pos)->occupancies, occupancies_copy, 24);                                      \
+	memcpy((pos)->board, board_copy, sizeof(board_copy));                                  \
+	(pos)->side = side_copy, (pos)->enpassant = enpassant_copy, (pos)->castle = castle_copy; \
+	(pos)->hash_key = hash_key_copy, (pos)->pawn_key = pawn_key_copy;                      \
+	(pos)->piece_square[0] = piece_square_copy[0], (pos)->piece_square[1] = piece_square_copy[1]; \
+	(pos)->phase_score = phase_score_copy;
 
 // Move types:
 enum
 {
 	all_moves,
-	only_captures
+	only_captures,
+	only_quiets
 };
 
+// Information make_move cannot recompute when taking the move back:
+typedef struct
+{
+	// Captured piece (no_piece for quiet and enpassant moves):
+	int captured;
+	// Enpassant square before the move:
+	int enpassant;
+	// Castling rights before the move:
+	int castle;
+	// Hash keys before the move:
+	U64 hash_key;
+	U64 pawn_key;
+	// Material, piece-square and game phase scores before the move:
+	int piece_square[2];
+	int phase_score;
+} undo;
+
 /*
 
 	 CR	    MU	   BIN  DEC  DESC
@@ -1784,14 +2548,168 @@ const int castling_rights[64] = {
 		15, 15, 15, 15, 15, 15, 15, 15,
 		13, 15, 15, 15, 12, 15, 15, 14};
 
-// Make move on chess board:
-static inline int make_move(int move, int move_flag)
+/*
+	The legal generator finds the checking pieces and the pieces pinned
+	against the own king once per node, so every move it emits is legal and
+	make_move can skip the king attack test. legal_move_generation switches
+	back to the pseudo legal generator (with the test in make_move) to
+	compare both.
+*/
+
+// Generate legal moves (0 selects the pseudo legal generator):
+int legal_move_generation = 1;
+
+// Update the NNUE accumulators for a move (taking it back swaps the added and removed pieces):
+static inline void update_accumulators_for_move(position *pos, int move, int captured, int take_back)
+{
+	// Parse the move:
+	int source_square = get_move_source(move);
+	int target_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
+	// Pieces added and removed by the move (piece * 64 + square):
+	int added[2], removed[2], adds = 0, removes = 0;
+	// Move (or promote) the piece:
+	removed[removes++] = piece * 64 + source_square;
+	added[adds++] = (promoted ? promoted : piece) * 64 + target_square;
+	// Captured piece:
+	if (captured != no_piece)
+		removed[removes++] = captured * 64 + target_square;
+	// Pawn captured enpassant:
+	if (get_move_enpassant(move))
+		removed[removes++] = (piece == P) ? p * 64 + target_square + 8 : P * 64 + target_square - 8;
+	// Castling rook:
+	if (get_move_castling(move))
+	{
+		// Depending on king target square:
+		switch (target_square)
+		{
+		case (g1):
+			removed[removes++] = R * 64 + h1, added[adds++] = R * 64 + f1;
+			break;
+		case (c1):
+			removed[removes++] = R * 64 + a1, added[adds++] = R * 64 + d1;
+			break;
+		case (g8):
+			removed[removes++] = r * 64 + h8, added[adds++] = r * 64 + f8;
+			break;
+		case (c8):
+			removed[removes++] = r * 64 + a8, added[adds++] = r * 64 + d8;
+			break;
+		}
+	}
+	// Apply the feature deltas:
+	if (take_back)
+		update_accumulators(pos, removed, removes, added, adds);
+	else
+		update_accumulators(pos, added, adds, removed, removes);
+}
+
+// Take move back on chess board (reverses only the bits the move touched):
+static inline void unmake_move(position *pos, int move, undo *state)
+{
+	// Parse the move:
+	int source_square = get_move_source(move);
+	int target_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
+	// Give the move back to the side that made it:
+	pos->side ^= 1;
+	// Take the moved (or promoted) piece off the target square:
+	pop_bit(pos->bitboards[promoted ? promoted : piece], target_square);
+	// Put the piece back on the source square:
+	set_bit(pos->bitboards[piece], source_square);
+	// Move the piece back in the occupancies:
+	pos->occupancies[pos->side] ^= (1ULL << source_square) | (1ULL << target_square);
+	// Move the piece back in the mailbox (restoring the captured piece or the empty square):
+	pos->board[source_square] = piece;
+	pos->board[target_square] = state->captured;
+	// Put the captured piece back:
+	if (state->captured != no_piece)
+	{
+		set_bit(pos->bitboards[state->captured], target_square);
+		set_bit(pos->occupancies[pos->side ^ 1], target_square);
+	}
+	// Put the pawn captured enpassant back:
+	if (get_move_enpassant(move))
+	{
+		// White to move:
+		if (pos->side == white)
+		{
+			set_bit(pos->bitboards[p], target_square + 8);
+			set_bit(pos->occupancies[black], target_square + 8);
+			pos->board[target_square + 8] = p;
+		}
+		// Black to move:
+		else
+		{
+			set_bit(pos->bitboards[P], target_square - 8);
+			set_bit(pos->occupancies[white], target_square - 8);
+			pos->board[target_square - 8] = P;
+		}
+	}
+	// Move the castling rook back:
+	if (get_move_castling(move))
+	{
+		// Rook original and castled squares:
+		int rook_source = 0, rook_target = 0;
+		// Depending on king target square:
+		switch (target_square)
+		{
+		// White castles king side:
+		case (g1):
+			rook_source = h1, rook_target = f1;
+			break;
+		// White castles queen side:
+		case (c1):
+			rook_source = a1, rook_target = d1;
+			break;
+		// Black castles king side:
+		case (g8):
+			rook_source = h8, rook_target = f8;
+			break;
+		// Black castles queen side:
+		case (c8):
+			rook_source = a8, rook_target = d8;
+			break;
+		}
+		// Move the rook back:
+		U64 rook_squares = (1ULL << rook_source) | (1ULL << rook_target);
+		pos->bitboards[(pos->side == white) ? R : r] ^= rook_squares;
+		pos->occupancies[pos->side] ^= rook_squares;
+		pos->board[rook_source] = (pos->side == white) ? R : r;
+		pos->board[rook_target] = no_piece;
+	}
+	// Update both sides occupancies:
+	pos->occupancies[both] = pos->occupancies[white] | pos->occupancies[black];
+	// Restore the irreversible state:
+	pos->enpassant = state->enpassant;
+	pos->castle = state->castle;
+	pos->hash_key = state->hash_key;
+	pos->pawn_key = state->pawn_key;
+	pos->piece_square[0] = state->piece_square[0];
+	pos->piece_square[1] = state->piece_square[1];
+	pos->phase_score = state->phase_score;
+	// Take the move back from the NNUE accumulators:
+	if (use_nnue)
+		update_accumulators_for_move(pos, move, state->captured, 1);
+}
+
+// Make move on chess board (fills state for unmake_move):
+static inline int make_move(position *pos, int move, int move_flag, undo *state)
 {
 	// Quiet moves:
 	if (move_flag == all_moves)
 	{
-		// Preserve board state:
-		copy_board();
+		// Preserve the irreversible state (the captured piece comes from the mailbox, enpassant targets are empty):
+		state->captured = pos->board[get_move_target(move)];
+		state->enpassant = pos->enpassant;
+		state->castle = pos->castle;
+		state->hash_key = pos->hash_key;
+		state->pawn_key = pos->pawn_key;
+		state->piece_square[0] = pos->piece_square[0];
+		state->piece_square[1] = pos->piece_square[1];
+		state->phase_score = pos->phase_score;
 		// Parse the move:
 		int source_square = get_move_source(move);
 		int target_square = get_move_target(move);
@@ -1802,111 +2720,117 @@ static inline int make_move(int move, int move_flag)
 		int enpassant_flag = get_move_enpassant(move);
 		int castling_flag = get_move_castling(move);
 		// Move the piece:
-		pop_bit(bitboards[piece], source_square);
-		set_bit(bitboards[piece], target_square);
+		pop_bit(pos->bitboards[piece], source_square);
+		set_bit(pos->bitboards[piece], target_square);
+		// Move the piece in the occupancies:
+		pos->occupancies[pos->side] ^= (1ULL << source_square) | (1ULL << target_square);
+		// Move the piece in the mailbox:
+		pos->board[source_square] = no_piece;
+		pos->board[target_square] = promoted ? promoted : piece;
 		// Hash piece:
-		hash_key ^= piece_keys[piece][source_square]; // Remove the piece from source square in hash key.
-		hash_key ^= piece_keys[piece][target_square]; // Place the piece on target square in hash key.
-		// Handling capture moves:
-		if (capture_flag)
+		pos->hash_key ^= piece_keys[piece][source_square]; // Remove the piece from source square in hash key.
+		pos->hash_key ^= piece_keys[piece][target_square]; // Place the piece on target square in hash key.
+		// Score piece:
+		remove_piece_score(pos, piece, source_square);
+		add_piece_score(pos, piece, target_square);
+		// Hash pawn:
+		hash_pawn(pos, piece, source_square);
+		hash_pawn(pos, piece, target_square);
+		// Handling capture moves (enpassant captures are handled below):
+		if (capture_flag && state->captured != no_piece)
 		{
-			// Pick up bitboard piece index ranges depending on side:
-			int start_piece, end_piece;
-			// White to move:
-			if (side == white)
-			{
-				start_piece = p;
-				end_piece = k;
-			}
-			// Black to move:
-			else
-			{
-				start_piece = P;
-				end_piece = K;
-			}
-			// Loop over the bitboards of the opposite side to move:
-			for (int bb_piece = start_piece; bb_piece <= end_piece; bb_piece++)
-			{
-				// If there is a piece on the target square:
-				if (get_bit(bitboards[bb_piece], target_square))
-				{
-					// Pop the piece from the bitboard:
-					pop_bit(bitboards[bb_piece], target_square);
-					// Remove the piece from hash key:
-					hash_key ^= piece_keys[bb_piece][target_square];
-					break;
-				}
-			}
+			// Pop the piece from the bitboard:
+			pop_bit(pos->bitboards[state->captured], target_square);
+			// Pop the piece from the opponent occupancies:
+			pop_bit(pos->occupancies[pos->side ^ 1], target_square);
+			// Remove the piece from hash key:
+			pos->hash_key ^= piece_keys[state->captured][target_square];
+			// Remove the piece from the scores:
+			remove_piece_score(pos, state->captured, target_square);
+			hash_pawn(pos, state->captured, target_square);
 		}
 		// Handling pawn promotions:
 		if (promoted)
 		{
 			// White to move:
-			if (side == white)
+			if (pos->side == white)
 			{
 				// Erase the pawn from the target square:
-				pop_bit(bitboards[P], target_square);
-				// Remove the pawn from hash key:
-				hash_key ^= piece_keys[P][target_square];
+				pop_bit(pos->bitboards[P], target_square);
+				// Remove the pawn from hash key and scores:
+				pos->hash_key ^= piece_keys[P][target_square];
+				remove_piece_score(pos, P, target_square);
+				pos->pawn_key ^= piece_keys[P][target_square];
 			}
 			// Black to move:
 			else
 			{
 				// Erase the pawn from the target square:
-				pop_bit(bitboards[p], target_square);
-				// Remove the pawn from hash key:
-				hash_key ^= piece_keys[p][target_square];
+				pop_bit(pos->bitboards[p], target_square);
+				// Remove the pawn from hash key and scores:
+				pos->hash_key ^= piece_keys[p][target_square];
+				remove_piece_score(pos, p, target_square);
+				pos->pawn_key ^= piece_keys[p][target_square];
 			}
 			// Set up promoted piece on chess board:
-			set_bit(bitboards[promoted], target_square);
-			// Hash the promoted piece:
-			hash_key ^= piece_keys[promoted][target_square];
+			set_bit(pos->bitboards[promoted], target_square);
+			// Hash and score the promoted piece:
+			pos->hash_key ^= piece_keys[promoted][target_square];
+			add_piece_score(pos, promoted, target_square);
 		}
 		// Handling enpassant captures:
 		if (enpassant_flag)
 		{
 			// White to move:
-			if (side == white)
+			if (pos->side == white)
 			{
 				// Remove captured pawn:
-				pop_bit(bitboards[p], target_square + 8);
-				// Remove pawn from the hash key:
-				hash_key ^= piece_keys[p][target_square + 8];
+				pop_bit(pos->bitboards[p], target_square + 8);
+				pop_bit(pos->occupancies[black], target_square + 8);
+				pos->board[target_square + 8] = no_piece;
+				// Remove pawn from the hash key and scores:
+				pos->hash_key ^= piece_keys[p][target_square + 8];
+				remove_piece_score(pos, p, target_square + 8);
+				pos->pawn_key ^= piece_keys[p][target_square + 8];
 			}
 			// Black to move:
 			else
 			{
 				// Remove captured pawn:
-				pop_bit(bitboards[P], target_square - 8);
-				// Remove pawn from the hash key:
-				hash_key ^= piece_keys[P][target_square - 8];
+				pop_bit(pos->bitboards[P], target_square - 8);
+				pop_bit(pos->occupancies[white], target_square - 8);
+				pos->board[target_square - 8] = no_piece;
+				// Remove pawn from the hash key and scores:
+				pos->hash_key ^= piece_keys[P][target_square - 8];
+				remove_piece_score(pos, P, target_square - 8);
+				pos->pawn_key ^= piece_keys[P][target_square - 8];
 			}
 		}
 		// Hash enpassant if available (remove enpassant square from hash key):
-		if (enpassant != no_sq)
+		if (pos->enpassant != no_sq)
 		{
-			hash_key ^= enpassant_keys[enpassant];
+			pos->hash_key ^= enpassant_keys[pos->enpassant];
 		}
 		// Reseting the enpassant square:
-		enpassant = no_sq;
+		pos->enpassant = no_sq;
 		// Handling double pawn push:
 		if (double_flag)
 		{
 			// White to move:
-			if (side == white)
+			if (pos->side == white)
 			{
 				// Set the enpassant square:
-				enpassant = target_square + 8;
+				pos->enpassant = target_square + 8;
 				// Hash enpassant:
-				hash_key ^= enpassant_keys[target_square + 8];
+				pos->hash_key ^= enpassant_keys[target_square + 8];
 			}
 			// Black to move:
 			else
 			{
 				// Set the enpassant square:
-				enpassant = target_square - 8;
+				pos->enpassant = target_square - 8;
 				// Hash enpassant:
-				hash_key ^= enpassant_keys[target_square - 8];
+				pos->hash_key ^= enpassant_keys[target_square - 8];
 			}
 		}
 		// Handling the castling moves:
@@ -1918,83 +2842,95 @@ static inline int make_move(int move, int move_flag)
 			// White castles king side:
 			case (g1):
 				// Move the H rook:
-				pop_bit(bitboards[R], h1);
-				set_bit(bitboards[R], f1);
+				pop_bit(pos->bitboards[R], h1);
+				set_bit(pos->bitboards[R], f1);
+				pos->occupancies[white] ^= (1ULL << h1) | (1ULL << f1);
+				pos->board[h1] = no_piece;
+				pos->board[f1] = R;
 				// Hash rook:
-				hash_key ^= piece_keys[R][h1]; // Remove rook from h1 of the hash key.
-				hash_key ^= piece_keys[R][f1]; // Place rook on f1 in the hash key.
+				pos->hash_key ^= piece_keys[R][h1]; // Remove rook from h1 of the hash key.
+				pos->hash_key ^= piece_keys[R][f1]; // Place rook on f1 in the hash key.
+				// Score rook:
+				remove_piece_score(pos, R, h1);
+				add_piece_score(pos, R, f1);
 				break;
 			// White castles queen side:
 			case (c1):
 				// Move the H rook:
-				pop_bit(bitboards[R], a1);
-				set_bit(bitboards[R], d1);
+				pop_bit(pos->bitboards[R], a1);
+				set_bit(pos->bitboards[R], d1);
+				pos->occupancies[white] ^= (1ULL << a1) | (1ULL << d1);
+				pos->board[a1] = no_piece;
+				pos->board[d1] = R;
 				// Hash rook:
-				hash_key ^= piece_keys[R][a1]; // Remove rook from a1 of the hash key.
-				hash_key ^= piece_keys[R][d1]; // Place rook on d1 in the hash key.
+				pos->hash_key ^= piece_keys[R][a1]; // Remove rook from a1 of the hash key.
+				pos->hash_key ^= piece_keys[R][d1]; // Place rook on d1 in the hash key.
+				// Score rook:
+				remove_piece_score(pos, R, a1);
+				add_piece_score(pos, R, d1);
 				break;
 			// Black castles king side:
 			case (g8):
 				// Move the H rook:
-				pop_bit(bitboards[r], h8);
-				set_bit(bitboards[r], f8);
+				pop_bit(pos->bitboards[r], h8);
+				set_bit(pos->bitboards[r], f8);
+				pos->occupancies[black] ^= (1ULL << h8) | (1ULL << f8);
+				pos->board[h8] = no_piece;
+				pos->board[f8] = r;
 				// Hash rook:
-				hash_key ^= piece_keys[r][h8]; // Remove rook from h8 of the hash key.
-				hash_key ^= piece_keys[r][f8]; // Place rook on f8 in the hash key.
+				pos->hash_key ^= piece_keys[r][h8]; // Remove rook from h8 of the hash key.
+				pos->hash_key ^= piece_keys[r][f8]; // Place rook on f8 in the hash key.
+				// Score rook:
+				remove_piece_score(pos, r, h8);
+				add_piece_score(pos, r, f8);
 				break;
 			// Black castles queen side:
 			case (c8):
 				// Move the H rook:
-				pop_bit(bitboards[r], a8);
-				set_bit(bitboards[r], d8);
+				pop_bit(pos->bitboards[r], a8);
+				set_bit(pos->bitboards[r], d8);
+				pos->occupancies[black] ^= (1ULL << a8) | (1ULL << d8);
+				pos->board[a8] = no_piece;
+				pos->board[d8] = r;
 				// Hash rook:
-				hash_key ^= piece_keys[r][a8]; // Remove rook from a8 of the hash key.
-				hash_key ^= piece_keys[r][d8]; // Place rook on d8 in the hash key.
+				pos->hash_key ^= piece_keys[r][a8]; // Remove rook from a8 of the hash key.
+				pos->hash_key ^= piece_keys[r][d8]; // Place rook on d8 in the hash key.
+				// Score rook:
+				remove_piece_score(pos, r, a8);
+				add_piece_score(pos, r, d8);
 				break;
 			}
 		}
 		// Un-hash castling:
-		hash_key ^= castle_keys[castle];
+		pos->hash_key ^= castle_keys[pos->castle];
 		// Update castling rights:
-		castle &= castling_rights[source_square];
-		castle &= castling_rights[target_square];
+		pos->castle &= castling_rights[source_square];
+		pos->castle &= castling_rights[target_square];
 		// Hash castling again:
-		hash_key ^= castle_keys[castle];
-		// Reset occupancies:
-		memset(occupancies, 0ULL, 24);
-		// Loop over white pieces bitboards:
-		for (int bb_piece = P; bb_piece <= K; bb_piece++)
-		{
-			// Update white occupancies:
-			occupancies[white] |= bitboards[bb_piece];
-		}
-		// Loop over black pieces bitboards:
-		for (int bb_piece = p; bb_piece <= k; bb_piece++)
-		{
-			// Update black occupancies:
-			occupancies[black] |= bitboards[bb_piece];
-		}
+		pos->hash_key ^= castle_keys[pos->castle];
 		// Update both sides occupancies:
-		occupancies[both] |= occupancies[white];
-		occupancies[both] |= occupancies[black];
+		pos->occupancies[both] = pos->occupancies[white] | pos->occupancies[black];
 		// Change side to move:
-		side ^= 1;
+		pos->side ^= 1;
 
 		// Hash side:
-		hash_key ^= side_key;
+		pos->hash_key ^= side_key;
+		// Update the NNUE accumulators:
+		if (use_nnue)
+			update_accumulators_for_move(pos, move, state->captured, 0);
 
 		/*******************************************************************\
 		================ DEBUG HASH KEY INCREMENTAL UPDATES =================
 		\*******************************************************************/
 		/*
 		// Build hash key for the updated position (after move is made) from scratch:
-		U64 hash_from_scratch = generate_hash_key();
+		U64 hash_from_scratch = generate_hash_key(pos);
 		// In case the built hash key from scratch does not match
 		// the one that was incrementally updated we interrupt execution:
-		if (hash_key != hash_from_scratch)
+		if (pos->hash_key != hash_from_scratch)
 		{
 			// Print the board:
-			print_board();
+			print_board(pos);
 			// Print the code area:
 			printf("Make move:\n");
 			// Print the move:
@@ -2005,11 +2941,11 @@ static inline int make_move(int move, int move_flag)
 			getchar();
 		}
 		*/
-		// Make sure that the king was not exposed to a check:
-		if (is_square_attacked((side == white) ? get_ls1b_index(bitboards[k]) : get_ls1b_index(bitboards[K]), side))
+		// Make sure that the king was not exposed to a check (always true for legal generator moves):
+		if (!legal_move_generation && is_square_attacked(pos, (pos->side == white) ? get_ls1b_index(pos->bitboards[k]) : get_ls1b_index(pos->bitboards[K]), pos->side))
 		{
 			// Move is illegal, take it back:
-			restore_board();
+			unmake_move(pos, move, state);
 			// Return illegal move:
 			return 0;
 		}
@@ -2025,7 +2961,7 @@ static inline int make_move(int move, int move_flag)
 		// Make sure the move is a capture:
 		if (get_move_capture(move))
 		{
-			make_move(move, all_moves);
+			return make_move(pos, move, all_moves, state);
 		}
 		// Otherwise the move is not a capture:
 		else
@@ -2035,8 +2971,14 @@ static inline int make_move(int move, int move_flag)
 	}
 }
 
-// Generate all moves:
-static inline void generate_moves(moves *move_list)
+/*
+	only_captures yields captures, enpassant and every promotion (quiet ones
+	too, they change the material like captures do); only_quiets yields the
+	rest, so both together produce exactly the all_moves list.
+*/
+
+// Generate pseudo legal moves of a given type:
+static inline void generate_pseudo_legal_moves(position *pos, moves *move_list, int move_type)
 {
 	// Initialize move count:
 	move_list->count = 0;
@@ -2044,13 +2986,15 @@ static inline void generate_moves(moves *move_list)
 	int source_square, target_square;
 	// Define current pieces bitboard copy and its attacks:
 	U64 bitboard, attacks;
+	// Target squares allowed by the move type (enemy pieces for captures, empty squares for quiets):
+	U64 target_mask = (move_type == only_captures) ? pos->occupancies[pos->side ^ 1] : (move_type == only_quiets) ? ~pos->occupancies[both] : ~0ULL;
 	// Loop over all the bitboards:
 	for (int piece = P; piece <= k; piece++)
 	{
 		// Initializate piece bitboard copy:
-		bitboard = bitboards[piece];
+		bitboard = pos->bitboards[piece];
 		// Generate white pawns and white king castling moves:
-		if (side == white)
+		if (pos->side == white)
 		{
 			// Select white pawns bitboard index:
 			if (piece == P)
@@ -2063,29 +3007,29 @@ static inline void generate_moves(moves *move_list)
 					// Initialize target square:
 					target_square = source_square - 8;
 					// Generate quiet pawn moves:
-					if (!(target_square < a8) && !get_bit(occupancies[both], target_square))
+					if (!(target_square < a8) && !get_bit(pos->occupancies[both], target_square))
 					{
 						// Pawn promotion:
-						if (source_square >= a7 && source_square <= h7)
+						if ((source_square >= a7 && source_square <= h7) && move_type != only_quiets)
 						{
 							add_move(move_list, encode_move(source_square, target_square, piece, Q, 0, 0, 0, 0));
 							add_move(move_list, encode_move(source_square, target_square, piece, R, 0, 0, 0, 0));
 							add_move(move_list, encode_move(source_square, target_square, piece, B, 0, 0, 0, 0));
 							add_move(move_list, encode_move(source_square, target_square, piece, N, 0, 0, 0, 0));
 						}
-						else
+						else if (!(source_square >= a7 && source_square <= h7) && move_type != only_captures)
 						{
 							// One square pawn move:
 							add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 							// Two squares pawn move:
-							if ((source_square >= a2 && source_square <= h2) && !get_bit(occupancies[both], target_square - 8))
+							if ((source_square >= a2 && source_square <= h2) && !get_bit(pos->occupancies[both], target_square - 8))
 							{
 								add_move(move_list, encode_move(source_square, target_square - 8, piece, 0, 0, 1, 0, 0));
 							}
 						}
 					}
 					// Initialize pawn attacks bitboards:
-					attacks = pawn_attacks[side][source_square] & occupancies[black];
+					attacks = (move_type != only_quiets) ? pawn_attacks[pos->side][source_square] & pos->occupancies[black] : 0ULL;
 					// Generate pawn captures:
 					while (attacks)
 					{
@@ -2108,10 +3052,10 @@ static inline void generate_moves(moves *move_list)
 						pop_bit(attacks, target_square);
 					}
 					// Generate enpassant captures:
-					if (enpassant != no_sq)
+					if (pos->enpassant != no_sq && move_type != only_quiets)
 					{
 						// Lookup pawn attacks and bitwise AND with enpassant square (bit):
-						U64 enpassant_attacks = pawn_attacks[side][source_square] & (1ULL << enpassant);
+						U64 enpassant_attacks = pawn_attacks[pos->side][source_square] & (1ULL << pos->enpassant);
 						// Make sure that enpassant capture is available:
 						if (enpassant_attacks)
 						{
@@ -2125,29 +3069,29 @@ static inline void generate_moves(moves *move_list)
 				}
 			}
 			// Castling moves:
-			if (piece == K)
+			if (piece == K && move_type != only_captures)
 			{
 				// King side castling is available:
-				if (castle & wk)
+				if (pos->castle & wk)
 				{
 					// Make sure the squares betwen king and kings rook are empty:
-					if (!get_bit(occupancies[both], f1) && !get_bit(occupancies[both], g1))
+					if (!get_bit(pos->occupancies[both], f1) && !get_bit(pos->occupancies[both], g1))
 					{
 						// Make sure that king and destination square are not under attack:
-						if (!is_square_attacked(e1, black) && !is_square_attacked(f1, black))
+						if (!is_square_attacked(pos, e1, black) && !is_square_attacked(pos, f1, black))
 						{
 							add_move(move_list, encode_move(e1, g1, piece, 0, 0, 0, 0, 1));
 						}
 					}
 				}
 				// Queen side castling is available:
-				if (castle & wq)
+				if (pos->castle & wq)
 				{
 					// Make sure the squares betwen king and queens rook are empty:
-					if (!get_bit(occupancies[both], d1) && !get_bit(occupancies[both], c1) && !get_bit(occupancies[both], b1))
+					if (!get_bit(pos->occupancies[both], d1) && !get_bit(pos->occupancies[both], c1) && !get_bit(pos->occupancies[both], b1))
 					{
 						// Make sure that king and destination square are not under attack:
-						if (!is_square_attacked(e1, black) && !is_square_attacked(d1, black))
+						if (!is_square_attacked(pos, e1, black) && !is_square_attacked(pos, d1, black))
 						{
 							add_move(move_list, encode_move(e1, c1, piece, 0, 0, 0, 0, 1));
 						}
@@ -2169,29 +3113,29 @@ static inline void generate_moves(moves *move_list)
 					// Initialize target square:
 					target_square = source_square + 8;
 					// Generate quiet pawn moves:
-					if (!(target_square > h1) && !get_bit(occupancies[both], target_square))
+					if (!(target_square > h1) && !get_bit(pos->occupancies[both], target_square))
 					{
 						// Pawn promotion:
-						if (source_square >= a2 && source_square <= h2)
+						if ((source_square >= a2 && source_square <= h2) && move_type != only_quiets)
 						{
 							add_move(move_list, encode_move(source_square, target_square, piece, q, 0, 0, 0, 0));
 							add_move(move_list, encode_move(source_square, target_square, piece, r, 0, 0, 0, 0));
 							add_move(move_list, encode_move(source_square, target_square, piece, b, 0, 0, 0, 0));
 							add_move(move_list, encode_move(source_square, target_square, piece, n, 0, 0, 0, 0));
 						}
-						else
+						else if (!(source_square >= a2 && source_square <= h2) && move_type != only_captures)
 						{
 							// One square pawn move:
 							add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 							// Two squares pawn move:
-							if ((source_square >= a7 && source_square <= h7) && !get_bit(occupancies[both], target_square + 8))
+							if ((source_square >= a7 && source_square <= h7) && !get_bit(pos->occupancies[both], target_square + 8))
 							{
 								add_move(move_list, encode_move(source_square, target_square + 8, piece, 0, 0, 1, 0, 0));
 							}
 						}
 					}
 					// Initialize pawn attacks bitboards:
-					attacks = pawn_attacks[side][source_square] & occupancies[white];
+					attacks = (move_type != only_quiets) ? pawn_attacks[pos->side][source_square] & pos->occupancies[white] : 0ULL;
 					// Generate pawn captures:
 					while (attacks)
 					{
@@ -2214,10 +3158,10 @@ static inline void generate_moves(moves *move_list)
 						pop_bit(attacks, target_square);
 					}
 					// Generate enpassant captures:
-					if (enpassant != no_sq)
+					if (pos->enpassant != no_sq && move_type != only_quiets)
 					{
 						// Lookup pawn attacks and bitwise AND with enpassant square (bit):
-						U64 enpassant_attacks = pawn_attacks[side][source_square] & (1ULL << enpassant);
+						U64 enpassant_attacks = pawn_attacks[pos->side][source_square] & (1ULL << pos->enpassant);
 						// Make sure that enpassant capture is available:
 						if (enpassant_attacks)
 						{
@@ -2231,29 +3175,29 @@ static inline void generate_moves(moves *move_list)
 				}
 			}
 			// Castling moves:
-			if (piece == k)
+			if (piece == k && move_type != only_captures)
 			{
 				// King side castling is available:
-				if (castle & bk)
+				if (pos->castle & bk)
 				{
 					// Make sure the squares betwen king and kings rook are empty:
-					if (!get_bit(occupancies[both], f8) && !get_bit(occupancies[both], g8))
+					if (!get_bit(pos->occupancies[both], f8) && !get_bit(pos->occupancies[both], g8))
 					{
 						// Make sure that king and destination square are not under attack:
-						if (!is_square_attacked(e8, white) && !is_square_attacked(f8, white))
+						if (!is_square_attacked(pos, e8, white) && !is_square_attacked(pos, f8, white))
 						{
 							add_move(move_list, encode_move(e8, g8, piece, 0, 0, 0, 0, 1));
 						}
 					}
 				}
 				// Queen side castling is available:
-				if (castle & bq)
+				if (pos->castle & bq)
 				{
 					// Make sure the squares betwen king and queens rook are empty:
-					if (!get_bit(occupancies[both], d8) && !get_bit(occupancies[both], c8) && !get_bit(occupancies[both], b8))
+					if (!get_bit(pos->occupancies[both], d8) && !get_bit(pos->occupancies[both], c8) && !get_bit(pos->occupancies[both], b8))
 					{
 						// Make sure that king and destination square are not under attack:
-						if (!is_square_attacked(e8, white) && !is_square_attacked(d8, white))
+						if (!is_square_attacked(pos, e8, white) && !is_square_attacked(pos, d8, white))
 						{
 							add_move(move_list, encode_move(e8, c8, piece, 0, 0, 0, 0, 1));
 						}
@@ -2262,7 +3206,7 @@ static inline void generate_moves(moves *move_list)
 			}
 		}
 		// Generate knight moves:
-		if ((side == white) ? piece == N : piece == n)
+		if ((pos->side == white) ? piece == N : piece == n)
 		{
 			// Loop over source squares of piece bitboard copy:
 			while (bitboard)
@@ -2270,14 +3214,14 @@ static inline void generate_moves(moves *move_list)
 				// Initialize source square:
 				source_square = get_ls1b_index(bitboard);
 				// Initialize piece attacks in order to set target squares:
-				attacks = knight_attacks[source_square] & ((side == white) ? ~occupancies[white] : ~occupancies[black]);
+				attacks = knight_attacks[source_square] & ((pos->side == white) ? ~pos->occupancies[white] : ~pos->occupancies[black]) & target_mask;
 				// Loop over target squares available from generated attacks:
 				while (attacks)
 				{
 					// initialize target square:
 					target_square = get_ls1b_index(attacks);
 					// Quiet moves:
-					if (!get_bit(((side == white) ? occupancies[black] : occupancies[white]), target_square))
+					if (!get_bit(((pos->side == white) ? pos->occupancies[black] : pos->occupancies[white]), target_square))
 					{
 						add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 					}
@@ -2294,7 +3238,7 @@ static inline void generate_moves(moves *move_list)
 			}
 		}
 		// Generate bishop moves:
-		if ((side == white) ? piece == B : piece == b)
+		if ((pos->side == white) ? piece == B : piece == b)
 		{
 			// Loop over source squares of piece bitboard copy:
 			while (bitboard)
@@ -2302,14 +3246,14 @@ static inline void generate_moves(moves *move_list)
 				// Initialize source square:
 				source_square = get_ls1b_index(bitboard);
 				// Initialize piece attacks in order to set target squares:
-				attacks = get_bishop_attacks(source_square, occupancies[both]) & ((side == white) ? ~occupancies[white] : ~occupancies[black]);
+				attacks = get_bishop_attacks(source_square, pos->occupancies[both]) & ((pos->side == white) ? ~pos->occupancies[white] : ~pos->occupancies[black]) & target_mask;
 				// Loop over target squares available from generated attacks:
 				while (attacks)
 				{
 					// initialize target square:
 					target_square = get_ls1b_index(attacks);
 					// Quiet moves:
-					if (!get_bit(((side == white) ? occupancies[black] : occupancies[white]), target_square))
+					if (!get_bit(((pos->side == white) ? pos->occupancies[black] : pos->occupancies[white]), target_square))
 					{
 						add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 					}
@@ -2326,7 +3270,7 @@ static inline void generate_moves(moves *move_list)
 			}
 		}
 		// Generate rook moves:
-		if ((side == white) ? piece == R : piece == r)
+		if ((pos->side == white) ? piece == R : piece == r)
 		{
 			// Loop over source squares of piece bitboard copy:
 			while (bitboard)
@@ -2334,14 +3278,14 @@ static inline void generate_moves(moves *move_list)
 				// Initialize source square:
 				source_square = get_ls1b_index(bitboard);
 				// Initialize piece attacks in order to set target squares:
-				attacks = get_rook_attacks(source_square, occupancies[both]) & ((side == white) ? ~occupancies[white] : ~occupancies[black]);
+				attacks = get_rook_attacks(source_square, pos->occupancies[both]) & ((pos->side == white) ? ~pos->occupancies[white] : ~pos->occupancies[black]) & target_mask;
 				// Loop over target squares available from generated attacks:
 				while (attacks)
 				{
 					// initialize target square:
 					target_square = get_ls1b_index(attacks);
 					// Quiet moves:
-					if (!get_bit(((side == white) ? occupancies[black] : occupancies[white]), target_square))
+					if (!get_bit(((pos->side == white) ? pos->occupancies[black] : pos->occupancies[white]), target_square))
 					{
 						add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 					}
@@ -2358,7 +3302,7 @@ static inline void generate_moves(moves *move_list)
 			}
 		}
 		// Generate queen moves:
-		if ((side == white) ? piece == Q : piece == q)
+		if ((pos->side == white) ? piece == Q : piece == q)
 		{
 			// Loop over source squares of piece bitboard copy:
 			while (bitboard)
@@ -2366,14 +3310,14 @@ static inline void generate_moves(moves *move_list)
 				// Initialize source square:
 				source_square = get_ls1b_index(bitboard);
 				// Initialize piece attacks in order to set target squares:
-				attacks = get_queen_attacks(source_square, occupancies[both]) & ((side == white) ? ~occupancies[white] : ~occupancies[black]);
+				attacks = get_queen_attacks(source_square, pos->occupancies[both]) & ((pos->side == white) ? ~pos->occupancies[white] : ~pos->occupancies[black]) & target_mask;
 				// Loop over target squares available from generated attacks:
 				while (attacks)
 				{
 					// initialize target square:
 					target_square = get_ls1b_index(attacks);
 					// Quiet moves:
-					if (!get_bit(((side == white) ? occupancies[black] : occupancies[white]), target_square))
+					if (!get_bit(((pos->side == white) ? pos->occupancies[black] : pos->occupancies[white]), target_square))
 					{
 						add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 					}
@@ -2390,7 +3334,7 @@ static inline void generate_moves(moves *move_list)
 			}
 		}
 		// Generate king moves:
-		if ((side == white) ? piece == K : piece == k)
+		if ((pos->side == white) ? piece == K : piece == k)
 		{
 			// Loop over source squares of piece bitboard copy:
 			while (bitboard)
@@ -2398,14 +3342,14 @@ static inline void generate_moves(moves *move_list)
 				// Initialize source square:
 				source_square = get_ls1b_index(bitboard);
 				// Initialize piece attacks in order to set target squares:
-				attacks = king_attacks[source_square] & ((side == white) ? ~occupancies[white] : ~occupancies[black]);
+				attacks = king_attacks[source_square] & ((pos->side == white) ? ~pos->occupancies[white] : ~pos->occupancies[black]) & target_mask;
 				// Loop over target squares available from generated attacks:
 				while (attacks)
 				{
 					// initialize target square:
 					target_square = get_ls1b_index(attacks);
 					// Quiet moves:
-					if (!get_bit(((side == white) ? occupancies[black] : occupancies[white]), target_square))
+					if (!get_bit(((pos->side == white) ? pos->occupancies[black] : pos->occupancies[white]), target_square))
 					{
 						add_move(move_list, encode_move(source_square, target_square, piece, 0, 0, 0, 0, 0));
 					}
@@ -2424,54 +3368,477 @@ static inline void generate_moves(moves *move_list)
 	}
 }
 
+// Get the pieces of a given side pinned against its king:
+static inline U64 get_pinned_pieces(position *pos, int side, int king_square)
+{
+	// Pinned pieces bitboard:
+	U64 pinned = 0ULL;
+	// Enemy sliders that would attack the king through pieces of its side:
+	U64 snipers = (get_rook_attacks(king_square, pos->occupancies[side ^ 1]) &
+								 ((side == white) ? pos->bitboards[r] | pos->bitboards[q] : pos->bitboards[R] | pos->bitboards[Q])) |
+								(get_bishop_attacks(king_square, pos->occupancies[side ^ 1]) &
+								 ((side == white) ? pos->bitboards[b] | pos->bitboards[q] : pos->bitboards[B] | pos->bitboards[Q]));
+	// Loop over snipers:
+	while (snipers)
+	{
+		// Initialize sniper square:
+		int square = get_ls1b_index(snipers);
+		// Pieces between the sniper and the king:
+		U64 blockers = between_masks[king_square][square] & pos->occupancies[both];
+		// A single blocker of the king's side is pinned:
+		if (blockers && !(blockers & (blockers - 1)) && (blockers & pos->occupancies[side]))
+		{
+			pinned |= blockers;
+		}
+		// Pop LS1B from snipers:
+		pop_bit(snipers, square);
+	}
+	// Return pinned pieces:
+	return pinned;
+}
+
+// Generate legal moves of a given type:
+static inline void generate_legal_moves(position *pos, moves *move_list, int move_type)
+{
+	// Initialize move count:
+	move_list->count = 0;
+	// Define source and target squares:
+	int source_square, target_square;
+	// Define current pieces bitboard copy and its attacks:
+	U64 bitboard, attacks;
+	// Side to move and its king:
+	int side = pos->side;
+	int king = (side == white) ? K : k;
+	int king_square = get_ls1b_index(pos->bitboards[king]);
+	// Own, enemy and all pieces:
+	U64 own = pos->occupancies[side], enemy = pos->occupancies[side ^ 1], occupancy = pos->occupancies[both];
+	// Target squares allowed by the move type (enemy pieces for captures, empty squares for quiets):
+	U64 target_mask = (move_type == only_captures) ? enemy : (move_type == only_quiets) ? ~occupancy : ~0ULL;
+	// Enemy pieces giving check:
+	U64 checkers = get_attackers(pos, king_square, occupancy) & enemy;
+	// King moves (the king must not shield the squares behind it from sliders):
+	attacks = king_attacks[king_square] & ~own & target_mask;
+	while (attacks)
+	{
+		// Initialize target square:
+		target_square = get_ls1b_index(attacks);
+		// Target square must not be attacked:
+		if (!(get_attackers(pos, target_square, occupancy ^ (1ULL << king_square)) & enemy))
+		{
+			add_move(move_list, encode_move(king_square, target_square, king, 0, (get_bit(enemy, target_square) ? 1 : 0), 0, 0, 0));
+		}
+		// Pop the LS1B from attacks:
+		pop_bit(attacks, target_square);
+	}
+	// Only the king can move out of a double check:
+	if (checkers & (checkers - 1))
+	{
+		return;
+	}
+	// Target squares blocking or capturing a single checker:
+	U64 check_mask = checkers ? between_masks[king_square][get_ls1b_index(checkers)] | checkers : ~0ULL;
+	// Pieces pinned against the king:
+	U64 pinned = get_pinned_pieces(pos, side, king_square);
+	// Castling moves (neither out of, through nor into check):
+	if (!checkers && move_type != only_captures)
+	{
+		// White castling:
+		if (side == white)
+		{
+			// King side:
+			if ((pos->castle & wk) && !get_bit(occupancy, f1) && !get_bit(occupancy, g1) &&
+					!is_square_attacked(pos, f1, black) && !is_square_attacked(pos, g1, black))
+			{
+				add_move(move_list, encode_move(e1, g1, king, 0, 0, 0, 0, 1));
+			}
+			// Queen side:
+			if ((pos->castle & wq) && !get_bit(occupancy, d1) && !get_bit(occupancy, c1) && !get_bit(occupancy, b1) &&
+					!is_square_attacked(pos, d1, black) && !is_square_attacked(pos, c1, black))
+			{
+				add_move(move_list, encode_move(e1, c1, king, 0, 0, 0, 0, 1));
+			}
+		}
+		// Black castling:
+		else
+		{
+			// King side:
+			if ((pos->castle & bk) && !get_bit(occupancy, f8) && !get_bit(occupancy, g8) &&
+					!is_square_attacked(pos, f8, white) && !is_square_attacked(pos, g8, white))
+			{
+				add_move(move_list, encode_move(e8, g8, king, 0, 0, 0, 0, 1));
+			}
+			// Queen side:
+			if ((pos->castle & bq) && !get_bit(occupancy, d8) && !get_bit(occupancy, c8) && !get_bit(occupancy, b8) &&
+					!is_square_attacked(pos, d8, white) && !is_square_attacked(pos, c8, white))
+			{
+				add_move(move_list, encode_move(e8, c8, king, 0, 0, 0, 0, 1));
+			}
+		}
+	}
+	// Pawn piece, push direction and promotion pieces:
+	int pawn = (side == white) ? P : p;
+	int push = (side == white) ? -8 : 8;
+	int promotions[4] = {(side == white) ? Q : q, (side == white) ? R : r, (side == white) ? B : b, (side == white) ? N : n};
+	// Loop over pawns:
+	bitboard = pos->bitboards[pawn];
+	while (bitboard)
+	{
+		// Initialize source square:
+		source_square = get_ls1b_index(bitboard);
+		// Target squares allowed by checks and pins:
+		U64 allowed = check_mask & (get_bit(pinned, source_square) ? line_masks[king_square][source_square] : ~0ULL);
+		// Pawn is about to promote:
+		int promotion = (side == white) ? (source_square >= a7 && source_square <= h7) : (source_square >= a2 && source_square <= h2);
+		// Pawn pushes:
+		target_square = source_square + push;
+		if (!get_bit(occupancy, target_square))
+		{
+			// Single push (promotions are generated with the captures):
+			if (get_bit(allowed, target_square) && (promotion ? move_type != only_quiets : move_type != only_captures))
+			{
+				if (promotion)
+				{
+					for (int index = 0; index < 4; index++)
+						add_move(move_list, encode_move(source_square, target_square, pawn, promotions[index], 0, 0, 0, 0));
+				}
+				else
+				{
+					add_move(move_list, encode_move(source_square, target_square, pawn, 0, 0, 0, 0, 0));
+				}
+			}
+			// Double push:
+			if (move_type != only_captures && ((side == white) ? (source_square >= a2 && source_square <= h2) : (source_square >= a7 && source_square <= h7)) &&
+					!get_bit(occupancy, target_square + push) && get_bit(allowed, target_square + push))
+			{
+				add_move(move_list, encode_move(source_square, target_square + push, pawn, 0, 0, 1, 0, 0));
+			}
+		}
+		// Pawn captures:
+		if (move_type != only_quiets)
+		{
+			attacks = pawn_attacks[side][source_square] & enemy & allowed;
+			while (attacks)
+			{
+				// Initialize target square:
+				target_square = get_ls1b_index(attacks);
+				// Capture with or without promotion:
+				if (promotion)
+				{
+					for (int index = 0; index < 4; index++)
+						add_move(move_list, encode_move(source_square, target_square, pawn, promotions[index], 1, 0, 0, 0));
+				}
+				else
+				{
+					add_move(move_list, encode_move(source_square, target_square, pawn, 0, 1, 0, 0, 0));
+				}
+				// Pop the LS1B from attacks:
+				pop_bit(attacks, target_square);
+			}
+			// Enpassant capture (tested on the board after the capture, it may uncover a slider):
+			if (pos->enpassant != no_sq && get_bit(pawn_attacks[side][source_square], pos->enpassant))
+			{
+				// Captured pawn square and occupancy after the capture:
+				int captured_square = pos->enpassant - push;
+				U64 occupancy_after = (occupancy ^ (1ULL << source_square) ^ (1ULL << captured_square)) | (1ULL << pos->enpassant);
+				// King must not be attacked afterwards:
+				if (!(get_attackers(pos, king_square, occupancy_after) & enemy))
+				{
+					add_move(move_list, encode_move(source_square, pos->enpassant, pawn, 0, 1, 0, 1, 0));
+				}
+			}
+		}
+		// Pop LS1B from pawns bitboard copy:
+		pop_bit(bitboard, source_square);
+	}
+	// Loop over knights, bishops, rooks and queens:
+	for (int piece = pawn + 1; piece < king; piece++)
+	{
+		// Initializate piece bitboard copy:
+		bitboard = pos->bitboards[piece];
+		while (bitboard)
+		{
+			// Initialize source square:
+			source_square = get_ls1b_index(bitboard);
+			// Piece attacks:
+			if (piece == N || piece == n)
+				attacks = knight_attacks[source_square];
+			else if (piece == B || piece == b)
+				attacks = get_bishop_attacks(source_square, occupancy);
+			else if (piece == R || piece == r)
+				attacks = get_rook_attacks(source_square, occupancy);
+			else
+				attacks = get_queen_attacks(source_square, occupancy);
+			// Keep targets allowed by the move type and checks:
+			attacks &= ~own & target_mask & check_mask;
+			// Pinned pieces stay on the pin line:
+			if (get_bit(pinned, source_square))
+			{
+				attacks &= line_masks[king_square][source_square];
+			}
+			// Loop over target squares:
+			while (attacks)
+			{
+				// Initialize target square:
+				target_square = get_ls1b_index(attacks);
+				// Quiet move or capture:
+				add_move(move_list, encode_move(source_square, target_square, piece, 0, (get_bit(enemy, target_square) ? 1 : 0), 0, 0, 0));
+				// Pop LS1B in current attacks set:
+				pop_bit(attacks, target_square);
+			}
+			// Pop LS1B from the current piece bitboard copy:
+			pop_bit(bitboard, source_square);
+		}
+	}
+}
+
+// Generate all moves:
+static inline void generate_moves(position *pos, moves *move_list)
+{
+	if (legal_move_generation)
+		generate_legal_moves(pos, move_list, all_moves);
+	else
+		generate_pseudo_legal_moves(pos, move_list, all_moves);
+}
+
+// Generate captures and promotions:
+static inline void generate_captures(position *pos, moves *move_list)
+{
+	if (legal_move_generation)
+		generate_legal_moves(pos, move_list, only_captures);
+	else
+		generate_pseudo_legal_moves(pos, move_list, only_captures);
+}
+
+// Generate quiet moves (no captures, no promotions):
+static inline void generate_quiets(position *pos, moves *move_list)
+{
+	if (legal_move_generation)
+		generate_legal_moves(pos, move_list, only_quiets);
+	else
+		generate_pseudo_legal_moves(pos, move_list, only_quiets);
+}
+
+// Check that a move taken from elsewhere (hash or killer move) could be generated in the current position:
+static inline int is_pseudo_legal(position *pos, int move)
+{
+	// Parse the move:
+	int source_square = get_move_source(move);
+	int target_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
+	// The piece must belong to the side to move and stand on the source square:
+	if (move == 0 || piece > k || pos->board[source_square] != piece || (piece >= p) != (pos->side == black))
+	{
+		return 0;
+	}
+	// Castling moves (same conditions as in the move generator):
+	if (get_move_castling(move))
+	{
+		// Depending on king target square:
+		switch (target_square)
+		{
+		// White castles king side:
+		case (g1):
+			return piece == K && (pos->castle & wk) && !get_bit(pos->occupancies[both], f1) && !get_bit(pos->occupancies[both], g1) &&
+						 !is_square_attacked(pos, e1, black) && !is_square_attacked(pos, f1, black);
+		// White castles queen side:
+		case (c1):
+			return piece == K && (pos->castle & wq) && !get_bit(pos->occupancies[both], d1) && !get_bit(pos->occupancies[both], c1) && !get_bit(pos->occupancies[both], b1) &&
+						 !is_square_attacked(pos, e1, black) && !is_square_attacked(pos, d1, black);
+		// Black castles king side:
+		case (g8):
+			return piece == k && (pos->castle & bk) && !get_bit(pos->occupancies[both], f8) && !get_bit(pos->occupancies[both], g8) &&
+						 !is_square_attacked(pos, e8, white) && !is_square_attacked(pos, f8, white);
+		// Black castles queen side:
+		case (c8):
+			return piece == k && (pos->castle & bq) && !get_bit(pos->occupancies[both], d8) && !get_bit(pos->occupancies[both], c8) && !get_bit(pos->occupancies[both], b8) &&
+						 !is_square_attacked(pos, e8, white) && !is_square_attacked(pos, d8, white);
+		}
+		return 0;
+	}
+	// The target square can not hold a piece of the side to move:
+	if (get_bit(pos->occupancies[pos->side], target_square))
+	{
+		return 0;
+	}
+	// Pawn moves:
+	if (piece == P || piece == p)
+	{
+		// Enpassant captures:
+		if (get_move_enpassant(move))
+		{
+			return target_square == pos->enpassant && get_bit(pawn_attacks[pos->side][source_square], target_square);
+		}
+		// Promotion flag must match the target rank:
+		if ((promoted != 0) != ((piece == P) ? target_square <= h8 : target_square >= a1))
+		{
+			return 0;
+		}
+		// Pawn captures:
+		if (get_move_capture(move))
+		{
+			return pos->board[target_square] != no_piece && get_bit(pawn_attacks[pos->side][source_square], target_square);
+		}
+		// Pawn pushes need empty squares:
+		int push = (piece == P) ? -8 : 8;
+		if (pos->board[target_square] != no_piece)
+		{
+			return 0;
+		}
+		// Double pawn push:
+		if (get_move_double(move))
+		{
+			return ((piece == P) ? (source_square >= a2 && source_square <= h2) : (source_square >= a7 && source_square <= h7)) &&
+						 target_square == source_square + 2 * push && pos->board[source_square + push] == no_piece;
+		}
+		// Single pawn push:
+		return target_square == source_square + push;
+	}
+	// Other pieces neither promote, double push nor capture enpassant:
+	if (promoted || get_move_double(move) || get_move_enpassant(move))
+	{
+		return 0;
+	}
+	// Capture flag must match the target square:
+	if (!get_move_capture(move) != (pos->board[target_square] == no_piece))
+	{
+		return 0;
+	}
+	// Piece attacks from the source square:
+	U64 attacks;
+	// Depending on piece type:
+	switch (piece)
+	{
+	case N:
+	case n:
+		attacks = knight_attacks[source_square];
+		break;
+	case B:
+	case b:
+		attacks = get_bishop_attacks(source_square, pos->occupancies[both]);
+		break;
+	case R:
+	case r:
+		attacks = get_rook_attacks(source_square, pos->occupancies[both]);
+		break;
+	case Q:
+	case q:
+		attacks = get_queen_attacks(source_square, pos->occupancies[both]);
+		break;
+	default:
+		attacks = king_attacks[source_square];
+		break;
+	}
+	// The piece must attack the target square:
+	return get_bit(attacks, target_square) != 0;
+}
+
+// Check that a pseudo legal move does not leave the own king in check:
+static inline int is_legal(position *pos, int move)
+{
+	// Parse the move:
+	int source_square = get_move_source(move);
+	int target_square = get_move_target(move);
+	// Side to move, its king and the enemy pieces:
+	int side = pos->side;
+	int king_square = get_ls1b_index(pos->bitboards[(side == white) ? K : k]);
+	U64 enemy = pos->occupancies[side ^ 1], occupancy = pos->occupancies[both];
+	// King moves:
+	if (source_square == king_square)
+	{
+		// Castling (is_pseudo_legal already checked the king and the passed square):
+		if (get_move_castling(move))
+		{
+			return !is_square_attacked(pos, target_square, side ^ 1);
+		}
+		// Target square must not be attacked:
+		return !(get_attackers(pos, target_square, occupancy ^ (1ULL << king_square)) & enemy);
+	}
+	// Enpassant captures are tested on the board after the capture:
+	if (get_move_enpassant(move))
+	{
+		int captured_square = (side == white) ? target_square + 8 : target_square - 8;
+		U64 occupancy_after = (occupancy ^ (1ULL << source_square) ^ (1ULL << captured_square)) | (1ULL << target_square);
+		return !(get_attackers(pos, king_square, occupancy_after) & enemy);
+	}
+	// Enemy pieces giving check:
+	U64 checkers = get_attackers(pos, king_square, occupancy) & enemy;
+	if (checkers)
+	{
+		// Only the king can move out of a double check:
+		if (checkers & (checkers - 1))
+		{
+			return 0;
+		}
+		// A single check must be blocked or the checker captured:
+		if (!get_bit(between_masks[king_square][get_ls1b_index(checkers)] | checkers, target_square))
+		{
+			return 0;
+		}
+	}
+	// Pinned pieces stay on the pin line:
+	if (get_bit(get_pinned_pieces(pos, side, king_square), source_square) && !get_bit(line_masks[king_square][source_square], target_square))
+	{
+		return 0;
+	}
+	// Move is legal:
+	return 1;
+}
+
 /******************************************************************************\
 =================================== PERFT =====================================
 \******************************************************************************/
 
-// Leaf nodes (number of positions reached during the test of the moves generator at a given depth):
-U64 nodes;
+// Count frontier moves from the legal move list instead of making them (disable to validate make/unmake):
+int perft_bulk_counting = 1;
 
-// PERFT driver:
-static inline void perft_driver(int depth)
+// PERFT driver (returns the number of leaf nodes reached at a given depth):
+static inline U64 perft_driver(position *pos, int depth)
 {
 	// Recursion scape condition:
 	if (depth == 0)
 	{
-		// increments nodes count (count reached positions):
-		nodes++;
-		return;
+		// Count the reached position:
+		return 1;
 	}
+	// Leaf nodes counter:
+	U64 nodes = 0;
 	// Create a move list instance:
 	moves move_list[1];
 	// Generate moves:
-	generate_moves(move_list);
+	generate_moves(pos, move_list);
+	// Bulk count the last ply (every generated move is legal):
+	if (depth == 1 && perft_bulk_counting && legal_move_generation)
+	{
+		return move_list->count;
+	}
 	// Loop over generated moves:
 	for (int move_count = 0; move_count < move_list->count; move_count++)
 	{
-		// Preserve board state:
-		copy_board();
+		// Move undo information:
+		undo state[1];
 		// Make the move:
-		if (!make_move(move_list->moves[move_count], all_moves))
+		if (!make_move(pos, move_list->moves[move_count], all_moves, state))
 		{
 			continue;
 		}
 		// Call PERFT driver recursively:
-		perft_driver(depth - 1);
-		// Restore the board:
-		restore_board();
+		nodes += perft_driver(pos, depth - 1);
+		// Take the move back:
+		unmake_move(pos, move_list->moves[move_count], state);
 
 		/*******************************************************************\
 		================ DEBUG HASH KEY INCREMENTAL UPDATES =================
 		\*******************************************************************/
 		/*
 		// Build hash key for the updated position (after move is made) from scratch:
-		U64 hash_from_scratch = generate_hash_key();
+		U64 hash_from_scratch = generate_hash_key(pos);
 		// In case the built hash key from scratch does not match
 		// the one that was incrementally updated we interrupt execution:
-		if (hash_key != hash_from_scratch)
+		if (pos->hash_key != hash_from_scratch)
 		{
 			// Print the board:
-			print_board();
+			print_board(pos);
 			// Print the code area:
 			printf("Take move back:\n");
 			// Print the move:
@@ -2483,47 +3850,593 @@ static inline void perft_driver(int depth)
 		}
 		*/
 	}
+	// Return the leaf nodes count:
+	return nodes;
 }
 
-// PERFT test:
-void perft_test(int depth)
+/*
+	The perft hash stores subtree node counts keyed by the Zobrist key and the
+	remaining depth. It has its own size (PerftHash option, 0 disables it)
+	and is shared by the perft workers without locking: the key is stored
+	XORed with the data word, so an entry torn by two writers fails the check.
+*/
+
+// Perft hash entry:
+typedef struct
+{
+	// Position key XORed with the data word:
+	U64 key;
+	// Remaining depth (top 8 bits) and subtree node count:
+	U64 data;
+} perft_entry;
+
+// Perft hash statistics:
+typedef struct
+{
+	// Number of probes and hits:
+	U64 probes;
+	U64 hits;
+} perft_stats;
+
+// Perft hash table and its number of entries (a power of two):
+perft_entry *perft_hash_table = NULL;
+U64 perft_hash_entries = 0;
+
+// Perft hash size in MB:
+int perft_hash_mb = 0;
+
+// Pack remaining depth and node count into an entry data word:
+#define perft_data(depth, nodes) (((U64)(depth) << 56) | (nodes))
+
+// Clear the perft hash table:
+void clear_perft_hash_table()
+{
+	if (perft_hash_table != NULL)
+		memset(perft_hash_table, 0, perft_hash_entries * sizeof(perft_entry));
+}
+
+// Allocate the perft hash table (0 MB frees it and disables perft hashing):
+void init_perft_hash_table(int mb)
+{
+	// Free the previous table:
+	free(perft_hash_table);
+	perft_hash_table = NULL;
+	perft_hash_entries = 0;
+	perft_hash_mb = 0;
+	// Perft hashing disabled:
+	if (mb <= 0)
+		return;
+	// Largest power of two number of entries that fits:
+	U64 entries = 1;
+	while (entries * 2 * sizeof(perft_entry) <= (U64)mb * 0x100000)
+		entries *= 2;
+	// Allocate memory:
+	perft_hash_table = calloc(entries, sizeof(perft_entry));
+	// Memory allocation has failed:
+	if (perft_hash_table == NULL)
+	{
+		// Try to allocate with half size:
+		init_perft_hash_table(mb / 2);
+		return;
+	}
+	perft_hash_entries = entries;
+	perft_hash_mb = mb;
+}
+
+// PERFT driver with the perft hash table:
+static inline U64 perft_driver_hashed(position *pos, int depth, perft_stats *stats)
+{
+	// Recursion scape condition:
+	if (depth == 0)
+	{
+		// Count the reached position:
+		return 1;
+	}
+	// Probe the perft hash (shallow subtrees are cheaper to count than to store):
+	perft_entry *entry = &perft_hash_table[pos->hash_key & (perft_hash_entries - 1)];
+	if (depth >= 2)
+	{
+		stats->probes++;
+		// Take a snapshot of the entry (other threads may be writing to it):
+		perft_entry snapshot = *entry;
+		// Depth is stored rather than mixed into the key (Zobrist keys combine
+		// linearly, so an XORed depth term can alias another position):
+		if ((snapshot.key ^ snapshot.data) == pos->hash_key && (int)(snapshot.data >> 56) == depth)
+		{
+			stats->hits++;
+			return snapshot.data & 0x00ffffffffffffffULL;
+		}
+	}
+	// Leaf nodes counter:
+	U64 nodes = 0;
+	// Create a move list instance:
+	moves move_list[1];
+	// Generate moves:
+	generate_moves(pos, move_list);
+	// Bulk count the last ply (every generated move is legal):
+	if (depth == 1 && perft_bulk_counting && legal_move_generation)
+	{
+		return move_list->count;
+	}
+	// Loop over generated moves:
+	for (int move_count = 0; move_count < move_list->count; move_count++)
+	{
+		// Move undo information:
+		undo state[1];
+		// Make the move:
+		if (!make_move(pos, move_list->moves[move_count], all_moves, state))
+		{
+			continue;
+		}
+		// Call PERFT driver recursively:
+		nodes += perft_driver_hashed(pos, depth - 1, stats);
+		// Take the move back:
+		unmake_move(pos, move_list->moves[move_count], state);
+	}
+	// Store the subtree count:
+	if (depth >= 2)
+	{
+		U64 data = perft_data(depth, nodes);
+		entry->key = pos->hash_key ^ data;
+		entry->data = data;
+	}
+	// Return the leaf nodes count:
+	return nodes;
+}
+
+// Count PERFT leaf nodes, through the perft hash when it is enabled:
+static inline U64 perft_count(position *pos, int depth, perft_stats *stats)
+{
+	return perft_hash_entries ? perft_driver_hashed(pos, depth, stats) : perft_driver(pos, depth);
+}
+
+// Print perft hash statistics:
+void print_perft_stats(perft_stats *stats)
+{
+	if (perft_hash_entries)
+		printf("Perft hash: %dMB, %lld probes, %lld hits (%.1f%%)\n", perft_hash_mb, stats->probes, stats->hits,
+					 stats->probes ? 100.0 * stats->hits / stats->probes : 0.0);
+}
+
+// PERFT driver taking moves back with copy_board/restore_board snapshots (reference for unmake_move):
+static inline U64 perft_driver_snapshot(position *pos, int depth)
+{
+	// Recursion scape condition:
+	if (depth == 0)
+	{
+		// Count the reached position:
+		return 1;
+	}
+	// Leaf nodes counter:
+	U64 nodes = 0;
+	// Create a move list instance:
+	moves move_list[1];
+	// Generate moves:
+	generate_moves(pos, move_list);
+	// Loop over generated moves:
+	for (int move_count = 0; move_count < move_list->count; move_count++)
+	{
+		// Preserve board state:
+		copy_board(pos);
+		// Move undo information (unused, the snapshot restores the board):
+		undo state[1];
+		// Make the move:
+		if (!make_move(pos, move_list->moves[move_count], all_moves, state))
+		{
+			continue;
+		}
+		// Call PERFT driver recursively:
+		nodes += perft_driver_snapshot(pos, depth - 1);
+		// Restore the board:
+		restore_board(pos);
+	}
+	// Return the leaf nodes count:
+	return nodes;
+}
+
+// PERFT driver checking that unmake_move restores exactly the copy_board snapshot:
+U64 perft_check_unmake(position *pos, int depth, U64 *mismatches)
+{
+	// Recursion scape condition:
+	if (depth == 0)
+	{
+		// Count the reached position:
+		return 1;
+	}
+	// Leaf nodes counter:
+	U64 nodes = 0;
+	// Create a move list instance:
+	moves move_list[1];
+	// Generate moves:
+	generate_moves(pos, move_list);
+	// Loop over generated moves:
+	for (int move_count = 0; move_count < move_list->count; move_count++)
+	{
+		// Preserve board state:
+		copy_board(pos);
+		// Move undo information:
+		undo state[1];
+		// Make the move (illegal moves are taken back by make_move itself):
+		if (make_move(pos, move_list->moves[move_count], all_moves, state))
+		{
+			// Call PERFT driver recursively:
+			nodes += perft_check_unmake(pos, depth - 1, mismatches);
+			// Take the move back:
+			unmake_move(pos, move_list->moves[move_count], state);
+		}
+		// Compare the board with the snapshot:
+		if (memcmp(pos->bitboards, bitboards_copy, 96) || memcmp(pos->occupancies, occupancies_copy, 24) || memcmp(pos->board, board_copy, sizeof(board_copy)) ||
+				pos->side != side_copy || pos->enpassant != enpassant_copy || pos->castle != castle_copy || pos->hash_key != hash_key_copy || pos->pawn_key != pawn_key_copy ||
+				pos->piece_square[0] != piece_square_copy[0] || pos->piece_square[1] != piece_square_copy[1] || pos->phase_score != phase_score_copy)
+		{
+			// Report the first mismatches:
+			if ((*mismatches)++ < 10)
+			{
+				printf("unmake_move mismatch after move ");
+				print_move(move_list->moves[move_count]);
+				printf("\n");
+			}
+			// Continue from the correct board:
+			restore_board(pos);
+		}
+	}
+	// Return the leaf nodes count:
+	return nodes;
+}
+
+// Print PERFT divide line:
+static inline void print_perft_move(int move, U64 nodes)
+{
+	printf("move: %s%s%c nodes: %lld\n",
+				 square_to_coordinates[get_move_source(move)],
+				 square_to_coordinates[get_move_target(move)],
+				 promoted_pieces[get_move_promoted(move)],
+				 nodes);
+}
+
+// PERFT test:
+void perft_test(position *pos, int depth)
 {
 	printf("\nPerform PERFT test:\n\n");
+	// Leaf nodes counter:
+	U64 nodes = 0;
+	// Perft hash statistics:
+	perft_stats stats[1] = {{0, 0}};
+	clear_perft_hash_table();
 	// Create a move list instance:
 	moves move_list[1];
 	// Generate moves:
-	generate_moves(move_list);
+	generate_moves(pos, move_list);
 	// Initialize start time:
 	long start = get_time_ms();
 	// Loop over generated moves:
 	for (int move_count = 0; move_count < move_list->count; move_count++)
 	{
-		// Preserve board state:
-		copy_board();
+		// Move undo information:
+		undo state[1];
 		// Make the move:
-		if (!make_move(move_list->moves[move_count], all_moves))
+		if (!make_move(pos, move_list->moves[move_count], all_moves, state))
 		{
 			continue;
 		}
-		// Cummulative nodes:
-		long cummulative_nodes = nodes;
 		// Call PERFT driver recursively:
-		perft_driver(depth - 1);
-		// Old nodes:
-		long old_nodes = nodes - cummulative_nodes;
-		// Restore the board:
-		restore_board();
+		U64 old_nodes = perft_count(pos, depth - 1, stats);
+		// Cummulative nodes:
+		nodes += old_nodes;
+		// Take the move back:
+		unmake_move(pos, move_list->moves[move_count], state);
 		// Print move:
-		printf("move: %s%s%c nodes: %ld\n",
-					 square_to_coordinates[get_move_source(move_list->moves[move_count])],
-					 square_to_coordinates[get_move_target(move_list->moves[move_count])],
-					 promoted_pieces[get_move_promoted(move_list->moves[move_count])],
-					 old_nodes);
+		print_perft_move(move_list->moves[move_count], old_nodes);
+	}
+	// Print results:
+	printf("\nDepth: %d\n", depth);
+	printf("Nodes: %lld\n", nodes);
+	printf("Time: %ldms\n", get_time_ms() - start);
+	print_perft_stats(stats);
+	printf("\n");
+}
+
+/*
+	Parallel perft splits the tree below the root, and below ply 2 for
+	depths of 3 or more, into tasks. The tasks are dealt to the workers in
+	contiguous ranges; a worker takes tasks from the front of its own range
+	and, once it runs dry, steals from the back of the other ranges. Every
+	worker counts on its own copy of the position and the per task counts
+	are summed per root move afterwards, so the divide output does not
+	depend on the number of threads.
+*/
+
+// Max number of perft threads:
+#define max_perft_threads 256
+
+// Perft task (a root move, optionally followed by a reply):
+typedef struct
+{
+	// Index of the root move within the root move list:
+	int root;
+	// Moves to play from the root position:
+	int moves[2];
+	int count;
+	// Counted leaf nodes:
+	U64 nodes;
+} perft_task;
+
+// Perft task queue (a range of tasks owned by a worker):
+typedef struct
+{
+	// Queue lock (the owner and the thieves work on opposite ends):
+	pthread_mutex_t lock;
+	// Range of tasks left:
+	int head, tail;
+} perft_queue;
+
+// Perft worker:
+typedef struct
+{
+	// Worker id:
+	int id;
+	// Leaf nodes counted by this worker:
+	U64 nodes;
+	// Tasks taken from other workers:
+	int steals;
+	// Perft hash statistics:
+	perft_stats stats;
+} perft_worker;
+
+// Perft thread pool state:
+perft_task *perft_tasks;
+perft_queue perft_queues[max_perft_threads];
+int perft_workers;
+position *perft_root;
+int perft_depth;
+
+// Get next perft task for a worker (-1 when no task is left anywhere):
+static inline int get_perft_task(perft_worker *worker)
+{
+	// Task index:
+	int task = -1;
+	// Own queue (taken from the front):
+	perft_queue *queue = &perft_queues[worker->id];
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail)
+		task = queue->head++;
+	pthread_mutex_unlock(&queue->lock);
+	// Steal from the back of the other queues:
+	for (int offset = 1; task == -1 && offset < perft_workers; offset++)
+	{
+		queue = &perft_queues[(worker->id + offset) % perft_workers];
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail)
+		{
+			task = --queue->tail;
+			worker->steals++;
+		}
+		pthread_mutex_unlock(&queue->lock);
 	}
+	// Return task index:
+	return task;
+}
+
+// Perft worker thread:
+void *perft_worker_thread(void *arg)
+{
+	// Worker state:
+	perft_worker *worker = (perft_worker *)arg;
+	// Own copy of the root position:
+	position *pos = malloc(sizeof(position));
+	*pos = *perft_root;
+	// Run tasks until none is left:
+	int index;
+	while ((index = get_perft_task(worker)) != -1)
+	{
+		// Current task:
+		perft_task *task = &perft_tasks[index];
+		// Play the task moves:
+		undo states[2];
+		for (int count = 0; count < task->count; count++)
+			make_move(pos, task->moves[count], all_moves, &states[count]);
+		// Count the subtree:
+		task->nodes = perft_count(pos, perft_depth - task->count, &worker->stats);
+		worker->nodes += task->nodes;
+		// Take the task moves back:
+		for (int count = task->count - 1; count >= 0; count--)
+			unmake_move(pos, task->moves[count], &states[count]);
+	}
+	// Free the position copy:
+	free(pos);
+	return NULL;
+}
+
+// PERFT test on a work stealing thread pool:
+void perft_test_parallel(position *pos, int depth, int threads)
+{
+	// Serial PERFT:
+	if (threads <= 1 || depth < 2)
+	{
+		perft_test(pos, depth);
+		return;
+	}
+	printf("\nPerform PERFT test:\n\n");
+	// Initialize start time:
+	long start = get_time_ms();
+	// Generate root moves:
+	moves root_moves[1];
+	generate_moves(pos, root_moves);
+	// Root moves are legal (illegal pseudo legal moves are marked 0):
+	for (int root = 0; root < root_moves->count; root++)
+	{
+		undo state[1];
+		if (make_move(pos, root_moves->moves[root], all_moves, state))
+			unmake_move(pos, root_moves->moves[root], state);
+		else
+			root_moves->moves[root] = 0;
+	}
+	// Build the task list (below ply 2 for depth 3 and more):
+	perft_tasks = malloc(sizeof(perft_task) * 256 * ((depth >= 3) ? 256 : 1));
+	int task_count = 0;
+	for (int root = 0; root < root_moves->count; root++)
+	{
+		// Skip illegal root moves:
+		if (!root_moves->moves[root])
+			continue;
+		// One task per root move:
+		if (depth < 3)
+		{
+			perft_tasks[task_count++] = (perft_task){root, {root_moves->moves[root], 0}, 1, 0};
+			continue;
+		}
+		// One task per legal reply:
+		undo state[1];
+		make_move(pos, root_moves->moves[root], all_moves, state);
+		moves replies[1];
+		generate_moves(pos, replies);
+		for (int reply = 0; reply < replies->count; reply++)
+		{
+			undo reply_state[1];
+			if (make_move(pos, replies->moves[reply], all_moves, reply_state))
+			{
+				unmake_move(pos, replies->moves[reply], reply_state);
+				perft_tasks[task_count++] = (perft_task){root, {root_moves->moves[root], replies->moves[reply]}, 2, 0};
+			}
+		}
+		unmake_move(pos, root_moves->moves[root], state);
+	}
+	// Start with an empty perft hash:
+	clear_perft_hash_table();
+	// Clamp the number of workers:
+	perft_workers = (threads < max_perft_threads) ? threads : max_perft_threads;
+	perft_root = pos;
+	perft_depth = depth;
+	// Deal contiguous task ranges to the workers:
+	for (int id = 0; id < perft_workers; id++)
+	{
+		pthread_mutex_init(&perft_queues[id].lock, NULL);
+		perft_queues[id].head = (int)((long)task_count * id / perft_workers);
+		perft_queues[id].tail = (int)((long)task_count * (id + 1) / perft_workers);
+	}
+	// Start the workers:
+	pthread_t handles[max_perft_threads];
+	perft_worker workers[max_perft_threads];
+	for (int id = 0; id < perft_workers; id++)
+	{
+		workers[id] = (perft_worker){id, 0, 0, {0, 0}};
+		pthread_create(&handles[id], NULL, perft_worker_thread, &workers[id]);
+	}
+	// Wait for the workers:
+	U64 nodes = 0;
+	int steals = 0;
+	perft_stats stats[1] = {{0, 0}};
+	for (int id = 0; id < perft_workers; id++)
+	{
+		pthread_join(handles[id], NULL);
+		pthread_mutex_destroy(&perft_queues[id].lock);
+		nodes += workers[id].nodes;
+		steals += workers[id].steals;
+		stats->probes += workers[id].stats.probes;
+		stats->hits += workers[id].stats.hits;
+	}
+	// Print the divide output in root move order:
+	for (int root = 0, task = 0; root < root_moves->count; root++)
+	{
+		// Skip illegal root moves:
+		if (!root_moves->moves[root])
+			continue;
+		// Sum the tasks of the root move:
+		U64 root_nodes = 0;
+		while (task < task_count && perft_tasks[task].root == root)
+			root_nodes += perft_tasks[task++].nodes;
+		print_perft_move(root_moves->moves[root], root_nodes);
+	}
+	// Free the task list:
+	free(perft_tasks);
 	// Print results:
 	printf("\nDepth: %d\n", depth);
 	printf("Nodes: %lld\n", nodes);
-	printf("Time: %ldms\n\n", get_time_ms() - start);
+	printf("Time: %ldms\n", get_time_ms() - start);
+	printf("Threads: %d (%d tasks, %d stolen)\n", perft_workers, task_count, steals);
+	print_perft_stats(stats);
+	printf("\n");
+}
+
+// Perft suite entry:
+typedef struct
+{
+	// Position name and FEN:
+	char *name;
+	char *fen;
+	// Depth and known node count:
+	int depth;
+	U64 nodes;
+} perft_suite_entry;
+
+// Perft suite positions with known node counts:
+const perft_suite_entry perft_suite_entries[] = {
+		{"start", start_position, 6, 119060324ULL},
+		{"kiwipete", tricky_position, 5, 193690690ULL},
+		{"killer", killer_position, 5, 36112837ULL},
+		{"cmk", cmk_position, 5, 69838845ULL},
+		{"rook endgame", repetitions, 6, 93939957ULL},
+		{"position 3", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6, 11030083ULL},
+		{"position 4", "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5, 15833292ULL},
+		{"position 5", "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4, 2103487ULL},
+		{"position 6", "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4, 3894594ULL},
+		{"illegal ep move 1", "3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1", 6, 1134888ULL},
+		{"illegal ep move 2", "8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1", 6, 1015133ULL},
+		{"ep capture checks", "8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1", 6, 1440467ULL},
+		{"short castle check", "5k2/8/8/8/8/8/8/4K2R w K - 0 1", 6, 661072ULL},
+		{"long castle check", "3k4/8/8/8/8/8/8/R3K3 w Q - 0 1", 6, 803711ULL},
+		{"castle rights", "r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1", 4, 1274206ULL},
+		{"castling prevented", "r3k2r/8/3Q4/8/8/5q2/8/R3K2R b KQkq - 0 1", 4, 1720476ULL},
+		{"promote out of check", "2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1", 6, 3821001ULL},
+		{"discovered check", "8/8/1P2K3/8/2n5/1q6/8/5k2 b - - 0 1", 5, 1004658ULL},
+		{"promote to check", "4k3/1P6/8/8/8/8/K7/8 w - - 0 1", 6, 217342ULL},
+		{"under promote check", "8/P1k5/K7/8/8/8/8/8 w - - 0 1", 6, 92683ULL},
+		{"self stalemate", "K1k5/8/P7/8/8/8/8/8 w - - 0 1", 6, 2217ULL},
+		{"stalemate checkmate 1", "8/k1P5/8/1K6/8/8/8/8 w - - 0 1", 7, 567584ULL},
+		{"stalemate checkmate 2", "8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1", 4, 23527ULL}};
+
+// Run the perft suite with the current perft settings (returns the number of mismatches):
+int perft_suite()
+{
+	printf("\nPerform PERFT suite:\n\n");
+	// Suite position:
+	position pos[1];
+	// Suite totals:
+	int failures = 0;
+	U64 total_nodes = 0;
+	long total_time = 0;
+	// Loop over suite positions:
+	int count = sizeof(perft_suite_entries) / sizeof(perft_suite_entry);
+	for (int index = 0; index < count; index++)
+	{
+		const perft_suite_entry *entry = &perft_suite_entries[index];
+		// Set up the position:
+		parse_fen(pos, entry->fen);
+		// Start with an empty perft hash:
+		clear_perft_hash_table();
+		perft_stats stats[1] = {{0, 0}};
+		// Run perft:
+		long start = get_time_ms();
+		U64 nodes = perft_count(pos, entry->depth, stats);
+		long time_spent = get_time_ms() - start;
+		// Compare against the known count:
+		int passed = (nodes == entry->nodes);
+		failures += !passed;
+		total_nodes += nodes;
+		total_time += time_spent;
+		// Print the position result:
+		printf("%-22s depth %d %12lld nodes %7ldms %7.1f Mnps  %s", entry->name, entry->depth, nodes, time_spent,
+					 nodes / 1000.0 / (time_spent + 1), passed ? "ok" : "FAIL");
+		if (!passed)
+			printf(" (expected %lld)", entry->nodes);
+		printf("\n");
+	}
+	// Print suite results:
+	printf("\nNodes: %lld\n", total_nodes);
+	printf("Time: %ldms\n", total_time);
+	printf("Speed: %.1f Mnps\n", total_nodes / 1000.0 / (total_time + 1));
+	printf("Result: %s (%d of %d positions failed)\n\n", failures ? "FAIL" : "PASS", failures, count);
+	return failures;
 }
 
 /******************************************************************************\
@@ -2908,8 +4821,8 @@ void init_evaluation_masks()
 	}
 }
 
-// Get the game phase score:
-static inline int get_game_phase_score()
+// Initialize the incremental material + piece-square scores and game phase values:
+void init_piece_square_scores()
 {
 	/*
 		The game phase score of the game is derived from the pieces
@@ -2921,78 +4834,87 @@ static inline int get_game_phase_score()
 		4 * rook material score in the opening +
 		2 * queen material score in the opening
 	*/
-	// Initializate the pieces counter:
-	int white_piece_scores = 0;
-	int black_piece_scores = 0;
-	// Loop over white pieces:
-	for (int piece = N; piece <= Q; piece++)
-	{
-		white_piece_scores += count_bits(bitboards[piece]) * material_score[opening][piece];
-	}
-	// Loop over black pieces:
-	for (int piece = n; piece <= q; piece++)
+	// Loop over pieces:
+	for (int piece = P; piece <= k; piece++)
 	{
-		black_piece_scores += count_bits(bitboards[piece]) * -material_score[opening][piece];
+		// Piece type (same for both sides):
+		int type = piece % 6;
+		// Game phase value (opening material of knights, bishops, rooks and queens):
+		phase_values[piece] = (type >= KNIGHT && type <= QUEEN) ? abs(material_score[opening][piece]) : 0;
+		// Loop over board squares:
+		for (int square = 0; square < 64; square++)
+		{
+			// Loop over opening and endgame:
+			for (int phase = opening; phase <= endgame; phase++)
+			{
+				// Material plus positional score (mirrored and negated for black):
+				piece_square_scores[phase][piece][square] = material_score[phase][piece] +
+																										((piece <= K) ? positional_score[phase][type][square] : -positional_score[phase][type][mirror_scores[square]]);
+			}
+		}
 	}
-	// Return the game phase score:
-	return white_piece_scores + black_piece_scores;
 }
 
-// Position evaluation:
-static inline int evaluate()
+/*
+	The pawn terms depend on nothing but the pawns, which rarely change inside a
+	subtree. Each search thread caches them in its own pawn hash table, keyed
+	by the pawn key (the Zobrist key of the pawns only, updated by make_move),
+	along with the open and semi open files the rook and king terms look at.
+*/
+
+// Pawn hash entry:
+typedef struct
 {
-	// Get the game phase score:
-	int game_phase_score = get_game_phase_score();
-	// Initialize the game phase variable:
-	int game_phase = -1;
-	// Define the game phase based on game phase score:
-	if (game_phase_score > opening_phase_score)
-	{
-		game_phase = opening;
-	}
-	else if (game_phase_score < endgame_phase_score)
-	{
-		game_phase = endgame;
-	}
-	else
-	{
-		game_phase = middlegame;
-	}
-	// Static evaluation score:
-	int score = 0;
+	// Pawn key:
+	U64 key;
+	// Pawn structure scores (white minus black):
+	int score_opening;
+	int score_endgame;
+	// Files without pawns and files without own pawns [side] (bit per file):
+	int open_files;
+	int semi_open_files[2];
+} pawn_entry;
+
+// Pawn hash table (one per search thread) and its statistics:
+typedef struct
+{
+	pawn_entry *entries;
+	U64 probes;
+	U64 hits;
+} pawn_table;
+
+// Pawn hash entries per thread (a power of two):
+#define pawn_hash_entries 16384
+
+// Evaluate the pawn structure:
+static inline void evaluate_pawns(position *pos, pawn_entry *entry)
+{
+	// Pawn structure scores:
 	int score_opening = 0;
 	int score_endgame = 0;
-	// Current pieces bitboard copy:
+	// Current pawns bitboard copy:
 	U64 bitboard;
-	// Initialize piece and square:
-	int piece, square;
+	// Initialize square:
+	int square;
 	// Penalties:
 	int double_pawns = 0;
-	// Loop over the pieces bitboards:
-	for (int bb_piece = P; bb_piece <= k; bb_piece++)
+	// Loop over white and black pawns:
+	for (int piece = P; piece <= p; piece += p - P)
 	{
-		// Initialize piece bitboard copy:
-		bitboard = bitboards[bb_piece];
-		// Loop over pieces within a bitboard:
+		// Initialize pawns bitboard copy:
+		bitboard = pos->bitboards[piece];
+		// Loop over pawns within a bitboard:
 		while (bitboard)
 		{
-			// Initialize the piece:
-			piece = bb_piece;
 			// Initialize square:
 			square = get_ls1b_index(bitboard);
-			// Calculate material (opening and endgame) scores:
-			score_opening += material_score[opening][piece];
-			score_endgame += material_score[endgame][piece];
-			// Score positional weights:
+			// Score pawn structure:
 			switch (piece)
 			{
-			// Evaluate white pieces:
+			// Evaluate white pawns:
 			case P:
-				// Calculate positional (opening and endgame) scores:
-				score_opening += positional_score[opening][PAWN][square];
-				score_endgame += positional_score[endgame][PAWN][square];
 				// Double pawn penalty:
-				double_pawns = count_bits(bitboards[P] & file_masks[square]);
+				double_pawns = count_bits(pos->bitboards[P] & file_masks[square]);
 				// On double pawns (tripple, etc):
 				if (double_pawns > 1)
 				{
@@ -3001,137 +4923,208 @@ static inline int evaluate()
 					score_endgame += (double_pawns - 1) * double_pawn_penalty_endgame;
 				}
 				// On isolated pawn:
-				if ((bitboards[P] & isolated_masks[square]) == 0)
+				if ((pos->bitboards[P] & isolated_masks[square]) == 0)
 				{
 					// Aply the penalty:
 					score_opening += isolated_pawn_penalty_opening;
 					score_endgame += isolated_pawn_penalty_endgame;
 				}
 				// On passed pawn:
-				if ((white_passed_masks[square] & bitboards[p]) == 0)
+				if ((white_passed_masks[square] & pos->bitboards[p]) == 0)
 				{
 					// Aply the bonus:
 					score_opening += passed_pawn_bonus[get_rank[square]];
 					score_endgame += passed_pawn_bonus[get_rank[square]];
 				}
 				break;
-			case N:
-				// Calculate positional (opening and endgame) scores:
-				score_opening += positional_score[opening][KNIGHT][square];
-				score_endgame += positional_score[endgame][KNIGHT][square];
-				break;
-			case B:
-				// Calculate positional (opening and endgame) scores:
-				score_opening += positional_score[opening][BISHOP][square];
-				score_endgame += positional_score[endgame][BISHOP][square];
-				// Mobility modifiers:
-				score_opening += (count_bits(get_bishop_attacks(square, occupancies[both])) - bishop_unit) * bishop_mobility_opening;
-				score_endgame += (count_bits(get_bishop_attacks(square, occupancies[both])) - bishop_unit) * bishop_mobility_endgame; 
-				break;
-			case R:
-				// Calculate positional (opening and endgame) scores:
-				score_opening += positional_score[opening][ROOK][square];
-				score_endgame += positional_score[endgame][ROOK][square];
-				// Semi open file:
-				if ((bitboards[P] & file_masks[square]) == 0)
+			// Evaluate black pawns:
+			case p:
+				// Double pawn penalty:
+				double_pawns = count_bits(pos->bitboards[p] & file_masks[square]);
+				// On double pawns (tripple, etc):
+				if (double_pawns > 1)
 				{
-					// Aply the bonus:
-					score_opening += semi_open_file_score;
-					score_endgame += semi_open_file_score;
+					// Aply the penalty:
+					score_opening -= (double_pawns - 1) * double_pawn_penalty_opening;
+					score_endgame -= (double_pawns - 1) * double_pawn_penalty_endgame;
 				}
-				// Open file:
-				if (((bitboards[P] | bitboards[p]) & file_masks[square]) == 0)
+				// On isolated pawn:
+				if ((pos->bitboards[p] & isolated_masks[square]) == 0)
+				{
+					// Aply the penalty
+					score_opening -= isolated_pawn_penalty_opening;
+					score_endgame -= isolated_pawn_penalty_endgame;
+				}
+				// On passed pawn:
+				if ((black_passed_masks[square] & pos->bitboards[P]) == 0)
 				{
 					// Aply the bonus:
-					score_opening += open_file_score;
-					score_endgame += open_file_score;
+					score_opening -= passed_pawn_bonus[get_rank[square]];
+					score_endgame -= passed_pawn_bonus[get_rank[square]];
 				}
 				break;
-			case Q:
-				// Calculate positional (opening and endgame) scores:
-				score_opening += positional_score[opening][QUEEN][square];
-				score_endgame += positional_score[endgame][QUEEN][square];
-				// Mobility modifiers:
-				score_opening += (count_bits(get_queen_attacks(square, occupancies[both])) - queen_unit) * queen_mobility_opening;
-				score_endgame += (count_bits(get_queen_attacks(square, occupancies[both])) - queen_unit) * queen_mobility_endgame; 
-				break;
-			case K:
-				// Calculate positional (opening and endgame) scores:
-				score_opening += positional_score[opening][KING][square];
-				score_endgame += positional_score[endgame][KING][square];
-				// Semi open file:
-				if ((bitboards[P] & file_masks[square]) == 0)
-				{
-					// Aply the penalty:
-					score_opening -= semi_open_file_score;
-					score_endgame -= semi_open_file_score;
+			}
+			// Pop LS1B:
+			pop_bit(bitboard, square);
+		}
+	}
+	// Files without pawns and without own pawns:
+	entry->open_files = entry->semi_open_files[white] = entry->semi_open_files[black] = 0;
+	for (int file = 0; file < 8; file++)
+	{
+		if ((pos->bitboards[P] & file_masks[file]) == 0)
+			entry->semi_open_files[white] |= 1 << file;
+		if ((pos->bitboards[p] & file_masks[file]) == 0)
+			entry->semi_open_files[black] |= 1 << file;
+	}
+	entry->open_files = entry->semi_open_files[white] & entry->semi_open_files[black];
+	// Fill the entry:
+	entry->key = pos->pawn_key;
+	entry->score_opening = score_opening;
+	entry->score_endgame = score_endgame;
+}
+
+// Get the pawn structure entry of a position (evaluated into scratch without a pawn hash table):
+static inline pawn_entry *probe_pawn_hash(pawn_table *table, position *pos, pawn_entry *scratch)
+{
+	// No pawn hash table:
+	if (table == NULL || table->entries == NULL)
+	{
+		evaluate_pawns(pos, scratch);
+		return scratch;
+	}
+	// Entry responsible for the pawn structure:
+	pawn_entry *entry = &table->entries[pos->pawn_key & (pawn_hash_entries - 1)];
+	table->probes++;
+	// Same pawns:
+	if (entry->key == pos->pawn_key)
+	{
+		table->hits++;
+		return entry;
+	}
+	// Evaluate and store the pawn structure:
+	evaluate_pawns(pos, entry);
+	return entry;
+}
+
+// Position evaluation:
+static inline int evaluate(position *pos, pawn_table *pawn_hash)
+{
+	// Use the network when one is loaded and switched on:
+	if (use_nnue)
+		return evaluate_nnue(pos);
+	// Get the game phase score (kept up to date by make_move):
+	int game_phase_score = pos->phase_score;
+	// Initialize the game phase variable:
+	int game_phase = -1;
+	// Define the game phase based on game phase score:
+	if (game_phase_score > opening_phase_score)
+	{
+		game_phase = opening;
+	}
+	else if (game_phase_score < endgame_phase_score)
+	{
+		game_phase = endgame;
+	}
+	else
+	{
+		game_phase = middlegame;
+	}
+	// Static evaluation score (starting from material and piece-square scores):
+	int score = 0;
+	int score_opening = pos->piece_square[opening];
+	int score_endgame = pos->piece_square[endgame];
+	// Pawn structure (from the pawn hash table when available):
+	pawn_entry pawn_scratch[1];
+	pawn_entry *pawns = probe_pawn_hash(pawn_hash, pos, pawn_scratch);
+	score_opening += pawns->score_opening;
+	score_endgame += pawns->score_endgame;
+	// Current pieces bitboard copy:
+	U64 bitboard;
+	// Initialize piece and square:
+	int piece, square;
+	// Loop over the pieces bitboards:
+	for (int bb_piece = P; bb_piece <= k; bb_piece++)
+	{
+		// Pawns and knights have no terms beyond the pawn structure, material and piece-square scores:
+		if (bb_piece == P || bb_piece == N || bb_piece == p || bb_piece == n)
+		{
+			continue;
+		}
+		// Initialize piece bitboard copy:
+		bitboard = pos->bitboards[bb_piece];
+		// Loop over pieces within a bitboard:
+		while (bitboard)
+		{
+			// Initialize the piece:
+			piece = bb_piece;
+			// Initialize square:
+			square = get_ls1b_index(bitboard);
+			// Score positional weights:
+			switch (piece)
+			{
+			// Evaluate white pieces:
+			case B:
+				// Mobility modifiers:
+				score_opening += (count_bits(get_bishop_attacks(square, pos->occupancies[both])) - bishop_unit) * bishop_mobility_opening;
+				score_endgame += (count_bits(get_bishop_attacks(square, pos->occupancies[both])) - bishop_unit) * bishop_mobility_endgame; 
+				break;
+			case R:
+				// Semi open file:
+				if (pawns->semi_open_files[white] & (1 << (square & 7)))
+				{
+					// Aply the bonus:
+					score_opening += semi_open_file_score;
+					score_endgame += semi_open_file_score;
 				}
 				// Open file:
-				if (((bitboards[P] | bitboards[p]) & file_masks[square]) == 0)
+				if (pawns->open_files & (1 << (square & 7)))
 				{
-					// Aply the penalty:
-					score_opening -= open_file_score;
-					score_endgame -= open_file_score;
+					// Aply the bonus:
+					score_opening += open_file_score;
+					score_endgame += open_file_score;
 				}
-				// King safety bonus:
-				score_opening += count_bits(king_attacks[square] & occupancies[white]) * king_shield_bonus;
-				score_endgame += count_bits(king_attacks[square] & occupancies[white]) * king_shield_bonus;
 				break;
-			// Evaluate black pieces:
-			case p:
-				// Calculate positional (opening and endgame) scores:
-				score_opening -= positional_score[opening][PAWN][mirror_scores[square]];
-				score_endgame -= positional_score[endgame][PAWN][mirror_scores[square]];
-				// Double pawn penalty:
-				double_pawns = count_bits(bitboards[p] & file_masks[square]);
-				// On double pawns (tripple, etc):
-				if (double_pawns > 1)
+			case Q:
+				// Mobility modifiers:
+				score_opening += (count_bits(get_queen_attacks(square, pos->occupancies[both])) - queen_unit) * queen_mobility_opening;
+				score_endgame += (count_bits(get_queen_attacks(square, pos->occupancies[both])) - queen_unit) * queen_mobility_endgame; 
+				break;
+			case K:
+				// Semi open file:
+				if (pawns->semi_open_files[white] & (1 << (square & 7)))
 				{
 					// Aply the penalty:
-					score_opening -= (double_pawns - 1) * double_pawn_penalty_opening;
-					score_endgame -= (double_pawns - 1) * double_pawn_penalty_endgame;
-				}
-				// On isolated pawn:
-				if ((bitboards[p] & isolated_masks[square]) == 0)
-				{
-					// Aply the penalty
-					score_opening -= isolated_pawn_penalty_opening;
-					score_endgame -= isolated_pawn_penalty_endgame;
+					score_opening -= semi_open_file_score;
+					score_endgame -= semi_open_file_score;
 				}
-				// On passed pawn:
-				if ((black_passed_masks[square] & bitboards[P]) == 0)
+				// Open file:
+				if (pawns->open_files & (1 << (square & 7)))
 				{
-					// Aply the bonus:
-					score_opening -= passed_pawn_bonus[get_rank[square]];
-					score_endgame -= passed_pawn_bonus[get_rank[square]];
+					// Aply the penalty:
+					score_opening -= open_file_score;
+					score_endgame -= open_file_score;
 				}
+				// King safety bonus:
+				score_opening += count_bits(king_attacks[square] & pos->occupancies[white]) * king_shield_bonus;
+				score_endgame += count_bits(king_attacks[square] & pos->occupancies[white]) * king_shield_bonus;
 				break;
-			case n:
-				// Calculate positional (opening and endgame) scores:
-				score_opening -= positional_score[opening][KNIGHT][mirror_scores[square]];
-				score_endgame -= positional_score[endgame][KNIGHT][mirror_scores[square]];
-				break;
+			// Evaluate black pieces:
 			case b:
-				// Calculate positional (opening and endgame) scores:
-				score_opening -= positional_score[opening][BISHOP][mirror_scores[square]];
-				score_endgame -= positional_score[endgame][BISHOP][mirror_scores[square]];
 				// Mobility modifiers:
-				score_opening -= (count_bits(get_bishop_attacks(square, occupancies[both])) - bishop_unit) * bishop_mobility_opening;
-				score_endgame -= (count_bits(get_bishop_attacks(square, occupancies[both])) - bishop_unit) * bishop_mobility_endgame;  
+				score_opening -= (count_bits(get_bishop_attacks(square, pos->occupancies[both])) - bishop_unit) * bishop_mobility_opening;
+				score_endgame -= (count_bits(get_bishop_attacks(square, pos->occupancies[both])) - bishop_unit) * bishop_mobility_endgame;  
 				break;
 			case r:
-				// Calculate positional (opening and endgame) scores:
-				score_opening -= positional_score[opening][ROOK][mirror_scores[square]];
-				score_endgame -= positional_score[endgame][ROOK][mirror_scores[square]];
 				// Semi open file:
-				if ((bitboards[p] & file_masks[square]) == 0)
+				if (pawns->semi_open_files[black] & (1 << (square & 7)))
 				{
 					// Aply the bonus:
 					score_opening -= semi_open_file_score;
 					score_endgame -= semi_open_file_score;
 				}
 				// Open file:
-				if (((bitboards[P] | bitboards[p]) & file_masks[square]) == 0)
+				if (pawns->open_files & (1 << (square & 7)))
 				{    
 					// Aply the bonus:
 					score_opening -= open_file_score;
@@ -3139,34 +5132,28 @@ static inline int evaluate()
 				}
 				break;
 			case q:
-				// Calculate positional (opening and endgame) scores:
-				score_opening -= positional_score[opening][QUEEN][mirror_scores[square]];
-				score_endgame -= positional_score[endgame][QUEEN][mirror_scores[square]];
 				// Mobility modifier:
-				score_opening -= (count_bits(get_queen_attacks(square, occupancies[both])) - queen_unit) * queen_mobility_opening;
-				score_endgame -= (count_bits(get_queen_attacks(square, occupancies[both])) - queen_unit) * queen_mobility_endgame;
+				score_opening -= (count_bits(get_queen_attacks(square, pos->occupancies[both])) - queen_unit) * queen_mobility_opening;
+				score_endgame -= (count_bits(get_queen_attacks(square, pos->occupancies[both])) - queen_unit) * queen_mobility_endgame;
 				break;
 			case k:
-				// Calculate positional (opening and endgame) scores:
-				score_opening -= positional_score[opening][KING][mirror_scores[square]];
-				score_endgame -= positional_score[endgame][KING][mirror_scores[square]];
 				// Semi open file:
-				if ((bitboards[p] & file_masks[square]) == 0)
+				if (pawns->semi_open_files[black] & (1 << (square & 7)))
 				{
 					// Aply the penalty:
 					score_opening += semi_open_file_score;
 					score_endgame += semi_open_file_score;
 				}
 				// Open file:
-				if (((bitboards[P] | bitboards[p]) & file_masks[square]) == 0)
+				if (pawns->open_files & (1 << (square & 7)))
 				{
 					// Aply the penalty:
 					score_opening += open_file_score;
 					score_endgame += open_file_score;
 				}
 				// King safety bonus:
-				score_opening -= count_bits(king_attacks[square] & occupancies[black]) * king_shield_bonus;
-				score_endgame -= count_bits(king_attacks[square] & occupancies[black]) * king_shield_bonus;
+				score_opening -= count_bits(king_attacks[square] & pos->occupancies[black]) * king_shield_bonus;
+				score_endgame -= count_bits(king_attacks[square] & pos->occupancies[black]) * king_shield_bonus;
 				break;
 			}
 			// Pop LS1B:
@@ -3205,7 +5192,7 @@ static inline int evaluate()
 		score = score_endgame;
 	}
 	// Return final evaluation based on side:
-	return (side == white) ? score : -score;
+	return (pos->side == white) ? score : -score;
 }
 
 /******************************************************************************\
@@ -3258,12 +5245,6 @@ static int mvv_lva[12][12] = {
 // Max reachable ply within a search:
 #define max_ply 64
 
-// Killer moves [id][ply]:
-int killer_moves[2][max_ply];
-
-// Hisotry moves [piece][square]:
-int history_moves[12][64];
-
 /*
 
 	================================
@@ -3288,21 +5269,55 @@ int history_moves[12][64];
 
 */
 
-// PV length [ply]:
-int pv_length[max_ply];
+// Search context (everything a single search needs besides the shared tables):
+typedef struct
+{
+	// Position being searched:
+	position pos;
+	// Half move counter:
+	int ply;
+	// Number of positions reached during the search:
+	U64 nodes;
+	// Killer moves [id][ply]:
+	int killer_moves[2][max_ply];
+	// History moves [piece][square]:
+	int history_moves[12][64];
+	// PV length [ply]:
+	int pv_length[max_ply];
+	// PV table [ply][ply]:
+	int pv_table[max_ply][max_ply];
+	// Follow PV:
+	int follow_pv;
+	// Thread id (the main thread is 0):
+	int id;
+	// Maximum search depth:
+	int depth;
+	// Pawn hash table (kept across searches):
+	pawn_table pawn_hash;
+	// Evaluation cache probes and hits:
+	U64 eval_probes;
+	U64 eval_hits;
+} search_context;
+
+// Max number of search threads:
+#define max_threads 256
 
-// PV table [ply][ply]:
-int pv_table[max_ply][max_ply];
+// Number of search threads:
+int thread_count = 1;
 
-// Follow PV and score PV move:
-int follow_pv, score_pv;
+// Search threads contexts:
+search_context search_threads[max_threads];
 
 /******************************************************************************\
 ============================ TRANSPOSITION TABLE ===============================
 \******************************************************************************/
 
-// Number of hash table entries:
-int hash_entries = 0;
+// Number of hash table buckets (a power of two) and the mask indexing them:
+U64 hash_buckets = 0;
+U64 hash_mask = 0;
+
+// Hash table size in MB:
+int hash_mb = 0;
 
 // No hash entry found constant:
 #define no_hash_entry 100000
@@ -3312,153 +5327,409 @@ int hash_entries = 0;
 #define hash_flag_alpha 1
 #define hash_flag_beta 2
 
-// Transposition table data structure:
+/*
+	HASH ENTRY DATA LAYOUT (one 64-bit word)
+
+	best move			→ bits 16-31	(source, target, promoted piece)
+	score + 0x10000		→ bits 32-48
+	depth				→ bits 49-55
+	hash flag			→ bits 56-57
+	generation			→ bits 58-63
+
+	Entries are grouped in 64-byte buckets (one cache line per probe). The
+	bucket index comes from the low bits of the hash key (the table size is a
+	power of two, so the index is a mask and not a 64-bit division). Like the
+	perft hash, an entry stores the full hash key XORed with its data word, so
+	threads read and write it without locking: an entry torn by two writers, or
+	one of another position, fails the check.
+*/
+
+// Hash entries per bucket:
+#define bucket_size 4
+
+// Largest hash table size in megabytes (Hash option):
+#define max_hash 1048576
+
+// Transposition table entry:
 typedef struct
 {
-	U64 hash_key;
-	int depth;
-	int flag;
-	int score;
+	// Position key XORed with the data word:
+	U64 key;
+	// Move, score, depth, flag and generation:
+	U64 data;
+} tt_entry;
+
+// Transposition table bucket:
+typedef struct
+{
+	tt_entry entries[bucket_size];
 } tt;
 
-// Define transposition table instance:
+// Pack hash entry data:
+#define encode_hash_entry(move, score, depth, flag, generation) \
+	(((U64)(move) << 16) |                                        \
+	 ((U64)((score) + 0x10000) << 32) |                           \
+	 ((U64)(depth) << 49) |                                       \
+	 ((U64)(flag) << 56) |                                        \
+	 ((U64)(generation) << 58))
+
+// Extract hash entry data properties:
+#define get_hash_move(entry) (int)(((entry) >> 16) & 0xffff)
+#define get_hash_score(entry) ((int)(((entry) >> 32) & 0x1ffff) - 0x10000)
+#define get_hash_depth(entry) (int)(((entry) >> 49) & 0x7f)
+#define get_hash_flag(entry) (int)(((entry) >> 56) & 0x3)
+#define get_hash_generation(entry) (int)((entry) >> 58)
+
+// Compact a move to its source, target and promoted piece:
+#define compact_move(move) (((move) & 0xfff) | (get_move_promoted(move) << 12))
+
+// Restore the full encoding of a compact move from the board (0 if there is no piece to move):
+static inline int expand_move(position *pos, int move)
+{
+	// Parse the compact move:
+	int source_square = move & 0x3f;
+	int target_square = (move >> 6) & 0x3f;
+	int promoted = move >> 12;
+	// Moving piece:
+	int piece = pos->board[source_square];
+	if (move == 0 || piece == no_piece)
+	{
+		return 0;
+	}
+	// Derive the move flags:
+	int pawn = (piece == P || piece == p);
+	int enpassant = pawn && target_square == pos->enpassant && (source_square & 7) != (target_square & 7);
+	int capture = enpassant || pos->board[target_square] != no_piece;
+	int double_push = pawn && abs(target_square - source_square) == 16;
+	int castling = (piece == K || piece == k) && abs(target_square - source_square) == 2;
+	// Return the full move (still to be checked with is_pseudo_legal):
+	return encode_move(source_square, target_square, piece, promoted, capture, double_push, enpassant, castling);
+}
+
+// Define transposition table instance and its memory page mode:
 tt *hash_table = NULL;
+int hash_page_mode = plain_pages;
+
+// Search generation (advanced on every search so older entries get replaced first):
+int hash_generation = 0;
+
+// Hash table chunk cleared by one thread:
+typedef struct
+{
+	char *start;
+	U64 size;
+} hash_chunk;
+
+// Clear a hash table chunk (thread entry point):
+void *clear_hash_chunk(void *arg)
+{
+	hash_chunk *chunk = (hash_chunk *)arg;
+	memset(chunk->start, 0, chunk->size);
+	return NULL;
+}
 
-// Clear the transposition table:
+// Clear the transposition table (split between the search threads, 16MB per thread at least):
 void clear_hash_table()
 {
-	// Initialize hash table entry pointer:
-	tt *hash_entry;
-	// Loop over TT elements:
-	for (hash_entry = hash_table; hash_entry < hash_table + hash_entries; hash_entry++)
+	// Reset the generation:
+	hash_generation = 0;
+	// No table yet:
+	if (hash_table == NULL)
+	{
+		return;
+	}
+	// Table size and number of clearing threads:
+	U64 size = hash_buckets * sizeof(tt);
+	int threads = thread_count;
+	if ((U64)threads > size / 0x1000000)
+		threads = (size / 0x1000000) ? (int)(size / 0x1000000) : 1;
+	// Cut the table in cache line aligned chunks (the last one takes the rest):
+	hash_chunk chunks[max_threads];
+	pthread_t handles[max_threads];
+	U64 chunk_size = (size / threads) & ~63ULL;
+	for (int id = 0; id < threads; id++)
 	{
-		// Initializate all the properties:
-		hash_entry->hash_key = 0;
-		hash_entry->depth = 0;
-		hash_entry->flag = 0;
-		hash_entry->score = 0;
+		chunks[id].start = (char *)hash_table + id * chunk_size;
+		chunks[id].size = (id == threads - 1) ? size - id * chunk_size : chunk_size;
 	}
+	// Clear the chunks in parallel (the calling thread takes the first one):
+	for (int id = 1; id < threads; id++)
+		pthread_create(&handles[id], NULL, clear_hash_chunk, &chunks[id]);
+	clear_hash_chunk(&chunks[0]);
+	for (int id = 1; id < threads; id++)
+		pthread_join(handles[id], NULL);
 }
 
 // Dynamically allocate memory for hash table:
 void init_hash_table(int mb)
 {
-    // Initialize hash size:
-    int hash_size = 0x100000 * mb;
-    // Initialize number of hash entries:
-    hash_entries =  hash_size / sizeof(tt);
-    // Free hash table if not empty:
-    if (hash_table != NULL)
-    {      
-        // Free hash table dynamic memory:
-        free(hash_table);
-    }
-    // Allocate memory:
-    hash_table = (tt *) malloc(hash_entries * sizeof(tt));
-    // Memory allocation has failed:
-    if (hash_table == NULL)
-    {    
-        // Try to allocate with half size:
-        init_hash_table(mb / 2);
-    }
-    // Memory allocation succeeded:
-    else
-    {
-        // Clear hash table:
-        clear_hash_table();
-    }    
+	// Free hash table if not empty:
+	large_page_free(hash_table, hash_buckets * sizeof(tt), hash_page_mode);
+	hash_table = NULL;
+	hash_buckets = hash_mask = 0;
+	hash_mb = 0;
+	// Largest power of two number of buckets that fits (64-bit sizes):
+	U64 buckets = 1;
+	while (buckets * 2 * sizeof(tt) <= (U64)mb * 0x100000)
+		buckets *= 2;
+	// Allocate memory (cache line aligned, on huge pages when possible):
+	hash_table = large_page_alloc(buckets * sizeof(tt), &hash_page_mode);
+	// Memory allocation has failed:
+	if (hash_table == NULL)
+	{
+		// Try to allocate with half size:
+		init_hash_table(mb / 2);
+		return;
+	}
+	hash_buckets = buckets;
+	hash_mask = buckets - 1;
+	hash_mb = (int)(buckets * sizeof(tt) / 0x100000);
+	// Clear hash table:
+	clear_hash_table();
+}
+
+// Hash table usage in permill (current search entries among the first 1000):
+int hash_full()
+{
+	// Used entries counter:
+	int used = 0;
+	// Sample the first buckets (fewer on tiny tables):
+	int buckets = ((U64)(1000 / bucket_size) < hash_buckets) ? 1000 / bucket_size : (int)hash_buckets;
+	if (buckets == 0)
+		return 0;
+	// Loop over the sampled buckets:
+	for (int index = 0; index < buckets; index++)
+	{
+		for (int slot = 0; slot < bucket_size; slot++)
+		{
+			U64 entry = hash_table[index].entries[slot].data;
+			used += get_hash_depth(entry) && get_hash_generation(entry) == hash_generation;
+		}
+	}
+	// Return the permill of the sampled entries:
+	return used * 1000 / (buckets * bucket_size);
+}
+
+// Advance the search generation (6 bits, wrapping around):
+static inline void new_search_generation()
+{
+	hash_generation = (hash_generation + 1) & 0x3f;
 }
 
 // Write hash entry data:
-static inline void write_hash_entry(int score, int depth, int hash_flag)
+static inline void write_hash_entry(search_context *ctx, int score, int depth, int hash_flag, int best_move)
 {
-	/* Create a TT instance pointer to the hash entry
-	responsible for storing a particular hash entry
-	scoring data for the current board position if available:	*/
-	tt *hash_entry = &hash_table[hash_key % hash_entries];
+	// Position being searched:
+	position *pos = &ctx->pos;
+	// Bucket responsible for the current board position:
+	tt *bucket = &hash_table[pos->hash_key & hash_mask];
 	// Store score independent from the actual path from
 	// root node (position) to current node (position):
 	if (score < -mate_score)
 	{
-		score -= ply;
+		score -= ctx->ply;
 	}
 	if (score > mate_score)
 	{
-		score += ply;
+		score += ctx->ply;
+	}
+	/* Pick the slot: the entry of the same position if there is one, otherwise the
+	shallowest of the depth-preferred slots when it is empty, stale (previous searches)
+	or no deeper than the new entry, otherwise the last (always-replace) slot. */
+	int slot = bucket_size - 1;
+	int victim = 0, victim_value = infinity;
+	for (int index = 0; index < bucket_size; index++)
+	{
+		tt_entry snapshot = bucket->entries[index];
+		U64 entry = snapshot.data;
+		// Same position:
+		if (get_hash_depth(entry) && (snapshot.key ^ entry) == pos->hash_key)
+		{
+			// Keep the known best move when there is no new one:
+			if (best_move == 0)
+				best_move = get_hash_move(entry);
+			victim = index, victim_value = -infinity;
+			break;
+		}
+		// Depth-preferred slots, empty and stale entries first:
+		if (index < bucket_size - 1)
+		{
+			int value = get_hash_depth(entry) - ((get_hash_generation(entry) != hash_generation) ? 128 : 0);
+			if (value < victim_value)
+				victim = index, victim_value = value;
+		}
 	}
-	// Fill the hash entry data:
-	hash_entry->hash_key = hash_key;
-	hash_entry->score = score;
-	hash_entry->flag = hash_flag;
-	hash_entry->depth = depth;
+	if (victim_value <= depth)
+		slot = victim;
+	// Fill the hash entry:
+	U64 data = encode_hash_entry(best_move, score, depth, hash_flag, hash_generation);
+	bucket->entries[slot].key = pos->hash_key ^ data;
+	bucket->entries[slot].data = data;
 }
 
 // Read hash entry data:
-static inline int read_hash_entry(int alpha, int beta, int depth)
+static inline int read_hash_entry(search_context *ctx, int alpha, int beta, int depth, int *hash_move)
 {
-	/* Create a TT instance pointer to the hash entry
-	responsible for storing a particular hash entry
-	scoring data for the current board position if available:	*/
-	tt *hash_entry = &hash_table[hash_key % hash_entries];
-	// Make sure dealing with the exact position on the board:
-	if (hash_entry->hash_key == hash_key)
+	// Position being searched:
+	position *pos = &ctx->pos;
+	// Bucket responsible for the current board position:
+	tt *bucket = &hash_table[pos->hash_key & hash_mask];
+	// Loop over bucket entries:
+	for (int index = 0; index < bucket_size; index++)
 	{
+		// Take a snapshot of the entry (other threads may be writing to it):
+		tt_entry snapshot = bucket->entries[index];
+		U64 entry = snapshot.data;
+		// Make sure dealing with the same position on the board:
+		if (get_hash_depth(entry) == 0 || (snapshot.key ^ entry) != pos->hash_key)
+		{
+			continue;
+		}
+		// Best move to try first (even if the score can not be used):
+		*hash_move = expand_move(pos, get_hash_move(entry));
 		// Make sure the depth matches exactly:
-		if (hash_entry->depth >= depth)
+		if (get_hash_depth(entry) >= depth)
 		{
 			// Extract stored score from TT entry:
-			int score = hash_entry->score;
+			int score = get_hash_score(entry);
 			// Retrieve score independent from the actual path from
 			// root node (position) to current node (position):
 			if (score < -mate_score)
 			{
-				score += ply;
+				score += ctx->ply;
 			}
 			if (score > mate_score)
 			{
-				score -= ply;
+				score -= ctx->ply;
 			}
 			// Match the exact (PV node) score:
-			if (hash_entry->flag == hash_flag_exact)
+			if (get_hash_flag(entry) == hash_flag_exact)
 			{
 				// Return the exact (PV node) score:
 				return score;
 			}
 			// Match the alpha (fail-low node) score:
-			if ((hash_entry->flag == hash_flag_alpha) && (score <= alpha))
+			if ((get_hash_flag(entry) == hash_flag_alpha) && (score <= alpha))
 			{
 				// Return the alpha (fail-low node) score:
 				return alpha;
 			}
 			// Match the beta (fail-high node) score:
-			if ((hash_entry->flag == hash_flag_beta) && (score >= beta))
+			if ((get_hash_flag(entry) == hash_flag_beta) && (score >= beta))
 			{
 				// Return the beta (fail-high node) score:
 				return beta;
 			}
 		}
+		// A position has a single entry in its bucket:
+		break;
 	}
 	// Return the unkown value:
 	return no_hash_entry;
 }
 
-// Enable PV move scoring:
-static inline void enable_pv_scoring(moves *move_list)
+/*
+	The evaluation cache stores static evaluations keyed by the Zobrist key
+	(side to move included). It is shared by the search threads without
+	locking, like the perft hash: the key is stored XORed with the data word.
+	Evaluations never go stale, so it only needs clearing when the
+	evaluation itself changes.
+*/
+
+// Evaluation cache entry:
+typedef struct
 {
-	// Disable following PV:
-	follow_pv = 0;
-	// Loop over the moves within a move list:
-	for (int count = 0; count < move_list->count; count++)
+	// Position key XORed with the data word:
+	U64 key;
+	// Valid tag (bit 32) and evaluation score (low 32 bits):
+	U64 data;
+} eval_entry;
+
+// Evaluation cache and its number of entries (a power of two):
+eval_entry *eval_cache = NULL;
+U64 eval_cache_entries = 0;
+
+// Evaluation cache size in MB (EvalCache option, 0 disables it):
+int eval_cache_mb = 0;
+
+// Default evaluation cache size in MB (the hand crafted evaluation is cheaper
+// than a cache miss, so it pays off only with a slower evaluation):
+#define eval_cache_default 0
+
+// Pack an evaluation score into an entry data word:
+#define eval_data(score) (0x100000000ULL | (unsigned)(score))
+
+// Clear the evaluation cache:
+void clear_eval_cache()
+{
+	if (eval_cache != NULL)
+		memset(eval_cache, 0, eval_cache_entries * sizeof(eval_entry));
+}
+
+// Allocate the evaluation cache (0 MB frees it and disables caching):
+void init_eval_cache(int mb)
+{
+	// Free the previous cache:
+	free(eval_cache);
+	eval_cache = NULL;
+	eval_cache_entries = 0;
+	eval_cache_mb = 0;
+	// Evaluation caching disabled:
+	if (mb <= 0)
+		return;
+	// Largest power of two number of entries that fits:
+	U64 entries = 1;
+	while (entries * 2 * sizeof(eval_entry) <= (U64)mb * 0x100000)
+		entries *= 2;
+	// Allocate memory:
+	eval_cache = calloc(entries, sizeof(eval_entry));
+	// Memory allocation has failed:
+	if (eval_cache == NULL)
 	{
-		// Make sure we hit PV move:
-		if (pv_table[0][ply] == move_list->moves[count])
-		{
-			// Enable move scoring:
-			score_pv = 1;
-			// Enable PV following:
-			follow_pv = 1;
-		}
+		// Try to allocate with half size:
+		init_eval_cache(mb / 2);
+		return;
 	}
+	eval_cache_entries = entries;
+	eval_cache_mb = mb;
+}
+
+// Free the per thread pawn hash tables and the evaluation cache:
+void free_eval_tables()
+{
+	for (int id = 0; id < max_threads; id++)
+	{
+		free(search_threads[id].pawn_hash.entries);
+		search_threads[id].pawn_hash.entries = NULL;
+	}
+	init_eval_cache(0);
+}
+
+// Evaluate the position being searched through the evaluation cache:
+static inline int evaluate_cached(search_context *ctx)
+{
+	// Position being searched:
+	position *pos = &ctx->pos;
+	// Evaluation caching disabled:
+	if (eval_cache == NULL)
+		return evaluate(pos, &ctx->pawn_hash);
+	// Probe the cache:
+	eval_entry *entry = &eval_cache[pos->hash_key & (eval_cache_entries - 1)];
+	ctx->eval_probes++;
+	// Take a snapshot of the entry (other threads may be writing to it):
+	eval_entry snapshot = *entry;
+	if ((snapshot.key ^ snapshot.data) == pos->hash_key && (snapshot.data >> 32))
+	{
+		ctx->eval_hits++;
+		return (int)(unsigned)snapshot.data;
+	}
+	// Evaluate and store the score:
+	int score = evaluate(pos, &ctx->pawn_hash);
+	U64 data = eval_data(score);
+	entry->key = pos->hash_key ^ data;
+	entry->data = data;
+	// Return the evaluation:
+	return score;
 }
 
 /*
@@ -3467,80 +5738,53 @@ static inline void enable_pv_scoring(moves *move_list)
 				Move ordering
 	=======================
 
-	1. PV move
-	2. Captures in MVV/LVA
-	3. 1st killer move
-	4. 2nd killer move
-	5. History moves
-	6. Unsorted moves
+	1. Captures in MVV/LVA
+	2. 1st killer move
+	3. 2nd killer move
+	4. History moves
+	5. Unsorted moves
+
+	(negamax orders through the move picker below, which tries the PV move first)
 
 */
 
 // Score moves function:
-static inline int score_move(int move)
+static inline int score_move(search_context *ctx, int move)
 {
-	// If PV move scoring is allowed:
-	if (score_pv)
-	{
-		// Make sure we are dealing with PV move:
-		if (pv_table[0][ply] == move)
-		{
-			// Disable PV score flag:
-			score_pv = 0;
-			// Give PV move the highest score to search it first:
-			return 20000;
-		}
-	}
+	// Position being searched:
+	position *pos = &ctx->pos;
 	// Score capture move:
 	if (get_move_capture(move))
 	{
-		// Initialize target piece:
-		int target_piece = P;
-		// Pick up bitboard piece index ranges depending on side:
-		int start_piece, end_piece;
-		// White to move:
-		if (side == white)
-		{
-			start_piece = p;
-			end_piece = k;
-		}
-		// Black to move:
-		else
-		{
-			start_piece = P;
-			end_piece = K;
-		}
-		// Loop over the bitboards of the opposite side to move:
-		for (int bb_piece = start_piece; bb_piece <= end_piece; bb_piece++)
-		{
-			// If there is a piece on the target square:
-			if (get_bit(bitboards[bb_piece], get_move_target(move)))
-			{
-				// Set up the target piece:
-				target_piece = bb_piece;
-				break;
-			}
-		}
+		// Look the target piece up in the mailbox (enpassant targets are empty and score as pawns):
+		int target_piece = pos->board[get_move_target(move)];
+		if (target_piece == no_piece)
+			target_piece = P;
 		// Score move by MVV LVA lookup [source_piece][target_piece]:
 		return mvv_lva[get_move_piece(move)][target_piece] + 10000;
 	}
+	// Score quiet promotion like capturing the promoted piece:
+	else if (get_move_promoted(move))
+	{
+		return mvv_lva[get_move_piece(move)][get_move_promoted(move)] + 10000;
+	}
 	// Score quiet move:
 	else
 	{
 		// Score 1st killer move:
-		if (killer_moves[0][ply] == move)
+		if (ctx->killer_moves[0][ctx->ply] == move)
 		{
 			return 9000;
 		}
 		// Score 2nd killer move:
-		else if (killer_moves[1][ply] == move)
+		else if (ctx->killer_moves[1][ctx->ply] == move)
 		{
 			return 8000;
 		}
 		// Score history moves:
 		else
 		{
-			return history_moves[get_move_piece(move)][get_move_target(move)];
+			return ctx->history_moves[get_move_piece(move)][get_move_target(move)];
 		}
 	}
 	// Return:
@@ -3548,7 +5792,7 @@ static inline int score_move(int move)
 }
 
 // Print the moves and its scores from a given move_list:
-void print_moves_scores(moves *move_list)
+void print_moves_scores(search_context *ctx, moves *move_list)
 {
 	// Print the header:
 	printf("+----------------+\n");
@@ -3567,36 +5811,36 @@ void print_moves_scores(moves *move_list)
 		}
 		print_move(move_list->moves[count]);
 		// Wich color to use for the move score:
-		if (score_move(move_list->moves[count]) >= 500)
+		if (score_move(ctx, move_list->moves[count]) >= 500)
 		{
-			printf("\033[0;30m  | \033[0;31m%5d\033[0;30m |\n", score_move(move_list->moves[count]));
+			printf("\033[0;30m  | \033[0;31m%5d\033[0;30m |\n", score_move(ctx, move_list->moves[count]));
 		}
-		else if (score_move(move_list->moves[count]) >= 300)
+		else if (score_move(ctx, move_list->moves[count]) >= 300)
 		{
-			printf("\033[0;30m  | \033[0;33m%5d\033[0;30m |\n", score_move(move_list->moves[count]));
+			printf("\033[0;30m  | \033[0;33m%5d\033[0;30m |\n", score_move(ctx, move_list->moves[count]));
 		}
-		else if (score_move(move_list->moves[count]) >= 100)
+		else if (score_move(ctx, move_list->moves[count]) >= 100)
 		{
-			printf("\033[0;30m  | \033[0;32m%5d\033[0;30m |\n", score_move(move_list->moves[count]));
+			printf("\033[0;30m  | \033[0;32m%5d\033[0;30m |\n", score_move(ctx, move_list->moves[count]));
 		}
 		else
 		{
-			printf("\033[0;30m  | \033[0;30m%5d\033[0;30m |\n", score_move(move_list->moves[count]));
+			printf("\033[0;30m  | \033[0;30m%5d\033[0;30m |\n", score_move(ctx, move_list->moves[count]));
 		}
 		printf("+--------+-------+\e[0m\n");
 	}
 }
 
 // Sort moves in descendent order:
-static inline int sort_moves(moves *move_list)
+static inline void sort_moves(search_context *ctx, moves *move_list)
 {
-	// Move scores array:
-	int moves_scores[move_list->count];
+	// Move scores array (sized like the move list, the list may be empty):
+	int moves_scores[256];
 	// Score all the moves on the moves list:
 	for (int count = 0; count < move_list->count; count++)
 	{
 		// Score current move:
-		moves_scores[count] = score_move(move_list->moves[count]);
+		moves_scores[count] = score_move(ctx, move_list->moves[count]);
 	}
 	// Loop over current move within a move list:
 	for (int current_move = 0; current_move < move_list->count; current_move++)
@@ -3620,14 +5864,272 @@ static inline int sort_moves(moves *move_list)
 	}
 }
 
+// Piece values for static exchange evaluation [piece]:
+const int see_values[12] = {100, 300, 350, 500, 1000, 10000, 100, 300, 350, 500, 1000, 10000};
+
+// Static exchange evaluation (material outcome of the capture sequence on the target square):
+static inline int see(position *pos, int move)
+{
+	// Parse the move:
+	int source_square = get_move_source(move);
+	int target_square = get_move_target(move);
+	// Material gains of the capture sequence:
+	int gain[32], depth = 0;
+	// Current capturing piece and its square:
+	int attacker = get_move_piece(move);
+	U64 attacker_bit = 1ULL << source_square;
+	// Occupancy with the captured pieces removed (including the pawn captured enpassant):
+	U64 occupancy = pos->occupancies[both];
+	if (get_move_enpassant(move))
+	{
+		pop_bit(occupancy, (pos->side == white) ? target_square + 8 : target_square - 8);
+	}
+	// Side making the next capture:
+	int side = pos->side;
+	// Initial capture (enpassant targets are empty and count as pawns):
+	gain[0] = (pos->board[target_square] != no_piece) ? see_values[pos->board[target_square]] : see_values[P];
+	// Play the capture sequence with the least valuable attackers:
+	do
+	{
+		// Speculative gain if the current attacker gets captured:
+		depth++;
+		gain[depth] = see_values[attacker] - gain[depth - 1];
+		// Neither side can improve by continuing:
+		if ((-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]) < 0)
+		{
+			break;
+		}
+		// Remove the attacker (uncovering x-ray attackers behind it):
+		occupancy ^= attacker_bit;
+		// Switch the capturing side:
+		side ^= 1;
+		// Find the least valuable attacker of the side:
+		U64 attackers = get_attackers(pos, target_square, occupancy) & pos->occupancies[side];
+		attacker_bit = 0ULL;
+		for (int piece = (side == white) ? P : p; piece <= ((side == white) ? K : k); piece++)
+		{
+			if (attackers & pos->bitboards[piece])
+			{
+				attacker = piece;
+				attacker_bit = (attackers & pos->bitboards[piece]) & -(attackers & pos->bitboards[piece]);
+				break;
+			}
+		}
+	} while (attacker_bit && depth < 31);
+	// Negamax the gains back to the initial capture:
+	while (--depth)
+	{
+		gain[depth - 1] = -(-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]);
+	}
+	// Return the material outcome:
+	return gain[0];
+}
+
+/*
+	The move picker yields the moves of a node one at a time and only
+	generates the next batch when the previous one is exhausted, so a node
+	cutting off on the hash move never generates anything:
+
+	1. Hash (PV) move
+	2. Winning and equal captures, queen promotions (MVV LVA)
+	3. 1st and 2nd killer moves
+	4. Quiet moves (history)
+	5. Losing captures and underpromotions (SEE < 0)
+*/
+
+// Move picker stages:
+enum
+{
+	stage_hash_move,
+	stage_generate_captures,
+	stage_good_captures,
+	stage_first_killer,
+	stage_second_killer,
+	stage_generate_quiets,
+	stage_quiets,
+	stage_bad_captures,
+	stage_done
+};
+
+// Move picker data structure:
+typedef struct
+{
+	// Current stage:
+	int stage;
+	// Hash move and killer moves (already tried when their stage comes):
+	int hash_move;
+	int killers[2];
+	// Moves of the current stage and their scores:
+	moves move_list[1];
+	int scores[256];
+	// Next move to pick from the current stage:
+	int index;
+	// Captures postponed to the last stage:
+	moves bad_captures[1];
+} move_picker;
+
+// Initialize the move picker:
+static inline void init_move_picker(search_context *ctx, move_picker *picker, int hash_move)
+{
+	// Start with the hash move:
+	picker->stage = stage_hash_move;
+	picker->hash_move = hash_move;
+	// Killer moves of the current ply:
+	picker->killers[0] = ctx->killer_moves[0][ctx->ply];
+	picker->killers[1] = ctx->killer_moves[1][ctx->ply];
+	// No postponed captures yet:
+	picker->bad_captures->count = 0;
+}
+
+// Pick the best scored move left in the current stage:
+static inline int pick_best_move(move_picker *picker)
+{
+	// Best move index:
+	int best = picker->index;
+	// Find the highest score:
+	for (int count = picker->index + 1; count < picker->move_list->count; count++)
+	{
+		if (picker->scores[count] > picker->scores[best])
+		{
+			best = count;
+		}
+	}
+	// Swap it to the front of the remaining moves:
+	int move = picker->move_list->moves[best];
+	picker->move_list->moves[best] = picker->move_list->moves[picker->index];
+	picker->scores[best] = picker->scores[picker->index];
+	picker->move_list->moves[picker->index] = move;
+	// Return the move advancing the index:
+	picker->index++;
+	return move;
+}
+
+// Get the next move to search (returns 0 when all moves have been yielded):
+static inline int next_move(search_context *ctx, move_picker *picker)
+{
+	// Position being searched:
+	position *pos = &ctx->pos;
+	// Current move:
+	int move;
+	// Depending on stage:
+	switch (picker->stage)
+	{
+	// Hash move:
+	case stage_hash_move:
+		picker->stage++;
+		if (picker->hash_move && is_pseudo_legal(pos, picker->hash_move) && (!legal_move_generation || is_legal(pos, picker->hash_move)))
+		{
+			return picker->hash_move;
+		}
+		/* fall through */
+	// Generate and score captures:
+	case stage_generate_captures:
+		generate_captures(pos, picker->move_list);
+		for (int count = 0; count < picker->move_list->count; count++)
+		{
+			// Captures by MVV LVA (enpassant as pawn captures), quiet promotions by the promoted piece:
+			move = picker->move_list->moves[count];
+			int target_piece = pos->board[get_move_target(move)];
+			if (get_move_capture(move))
+				picker->scores[count] = mvv_lva[get_move_piece(move)][(target_piece != no_piece) ? target_piece : P];
+			else
+				picker->scores[count] = see_values[get_move_promoted(move)];
+		}
+		picker->index = 0;
+		picker->stage++;
+		/* fall through */
+	// Winning and equal captures:
+	case stage_good_captures:
+		while (picker->index < picker->move_list->count)
+		{
+			// Pick the best remaining capture:
+			move = pick_best_move(picker);
+			// Skip the hash move:
+			if (move == picker->hash_move)
+			{
+				continue;
+			}
+			// Postpone underpromotions and losing captures:
+			int promoted = get_move_promoted(move);
+			int victim = pos->board[get_move_target(move)];
+			if ((promoted && promoted != Q && promoted != q) ||
+					(victim != no_piece && see_values[victim] < see_values[get_move_piece(move)] && see(pos, move) < 0))
+			{
+				add_move(picker->bad_captures, move);
+				continue;
+			}
+			return move;
+		}
+		picker->stage++;
+		/* fall through */
+	// 1st killer move:
+	case stage_first_killer:
+		picker->stage++;
+		move = picker->killers[0];
+		if (move && move != picker->hash_move && !get_move_capture(move) && !get_move_promoted(move) && is_pseudo_legal(pos, move) && (!legal_move_generation || is_legal(pos, move)))
+		{
+			return move;
+		}
+		/* fall through */
+	// 2nd killer move:
+	case stage_second_killer:
+		picker->stage++;
+		move = picker->killers[1];
+		if (move && move != picker->hash_move && move != picker->killers[0] && !get_move_capture(move) && !get_move_promoted(move) && is_pseudo_legal(pos, move) && (!legal_move_generation || is_legal(pos, move)))
+		{
+			return move;
+		}
+		/* fall through */
+	// Generate and score quiet moves:
+	case stage_generate_quiets:
+		generate_quiets(pos, picker->move_list);
+		for (int count = 0; count < picker->move_list->count; count++)
+		{
+			// Quiet moves by history:
+			move = picker->move_list->moves[count];
+			picker->scores[count] = ctx->history_moves[get_move_piece(move)][get_move_target(move)];
+		}
+		picker->index = 0;
+		picker->stage++;
+		/* fall through */
+	// Quiet moves:
+	case stage_quiets:
+		while (picker->index < picker->move_list->count)
+		{
+			// Pick the best remaining quiet move:
+			move = pick_best_move(picker);
+			// Skip the hash move and the killer moves:
+			if (move == picker->hash_move || move == picker->killers[0] || move == picker->killers[1])
+			{
+				continue;
+			}
+			return move;
+		}
+		picker->index = 0;
+		picker->stage++;
+		/* fall through */
+	// Losing captures (already in MVV LVA order):
+	case stage_bad_captures:
+		if (picker->index < picker->bad_captures->count)
+		{
+			return picker->bad_captures->moves[picker->index++];
+		}
+		picker->stage++;
+		/* fall through */
+	// No more moves:
+	default:
+		return 0;
+	}
+}
+
 // Position repetition detection:
-static inline int is_repetition()
+static inline int is_repetition(position *pos)
 {
 	// Loop over repetition indices range:
-	for (int index = 0; index < repetition_index; index++)
+	for (int index = 0; index < pos->repetition_index; index++)
 	{
 		// If found the hash key equals the current:
-		if (repetition_table[index] == hash_key)
+		if (pos->repetition_table[index] == pos->hash_key)
 		{
 			// Return that a repetition was found:
 			return 1;
@@ -3638,18 +6140,20 @@ static inline int is_repetition()
 }
 
 // Quiescence serach:
-static inline int quiescence(int alpha, int beta)
+static inline int quiescence(search_context *ctx, int alpha, int beta)
 {
-	// Every 2047 nodes:
-	if ((nodes & 2047) == 0)
+	// Position being searched:
+	position *pos = &ctx->pos;
+	// Every 2047 nodes (main thread only):
+	if ((ctx->nodes & 2047) == 0 && ctx->id == 0)
 	{
 		// "Listen" to the GUI/user input:
 		communicate();
 	}
 	// Increment nodes count:
-	nodes++;
+	ctx->nodes++;
 	// Evaluate position:
-	int evaluation = evaluate();
+	int evaluation = evaluate_cached(ctx);
 	// Fail-hard beta cutoff:
 	if (evaluation >= beta)
 	{
@@ -3664,38 +6168,44 @@ static inline int quiescence(int alpha, int beta)
 	}
 	// Create a move list instance:
 	moves move_list[1];
-	// Generate the moves:
-	generate_moves(move_list);
+	// Generate captures and promotions only:
+	generate_captures(pos, move_list);
 	// Sort the moves in the move list:
-	sort_moves(move_list);
+	sort_moves(ctx, move_list);
 	// Loop over moves within a movelist:
 	for (int count = 0; count < move_list->count; count++)
 	{
-		// Preserve the board state:
-		copy_board();
+		// Skip quiet underpromotions:
+		int promoted = get_move_promoted(move_list->moves[count]);
+		if (promoted && promoted != Q && promoted != q && !get_move_capture(move_list->moves[count]))
+		{
+			continue;
+		}
+		// Move undo information:
+		undo state[1];
 		// Increment the ply:
-		ply++;
+		ctx->ply++;
 		// Increment repetition index and store hash key:
-		repetition_index++;
-		repetition_table[repetition_index] = hash_key;
+		pos->repetition_index++;
+		pos->repetition_table[pos->repetition_index] = pos->hash_key;
 		// Make sure to make only legal moves:
-		if (make_move(move_list->moves[count], only_captures) == 0)
+		if (make_move(pos, move_list->moves[count], all_moves, state) == 0)
 		{
 			// Decrement ply:
-			ply--;
+			ctx->ply--;
 			// Decrement repetition index:
-			repetition_index--;
+			pos->repetition_index--;
 			// Skip to the next move:
 			continue;
 		}
 		// Score current move:
-		int score = -quiescence(-beta, -alpha);
+		int score = -quiescence(ctx, -beta, -alpha);
 		// Decrement ply:
-		ply--;
+		ctx->ply--;
 		// Decrement repetition index:
-		repetition_index--;
+		pos->repetition_index--;
 		// Take move back:
-		restore_board();
+		unmake_move(pos, move_list->moves[count], state);
 		// If time is up:
 		if (stopped == 1)
 		{
@@ -3723,31 +6233,37 @@ const int full_depth_moves = 4;
 const int reduction_limit = 3;
 
 // Negamax alpha beta search:
-static inline int negamax(int alpha, int beta, int depth)
+static inline int negamax(search_context *ctx, int alpha, int beta, int depth)
 {
+	// Position being searched:
+	position *pos = &ctx->pos;
 	// Initialize PV length:
-	pv_length[ply] = ply;
+	ctx->pv_length[ctx->ply] = ctx->ply;
 	// Initialize the current move score (from the static evaluation perspective):
 	int score;
 	// Define the hash flag:
 	int hash_flag = hash_flag_alpha;
+	// Best move found so far (stored in the hash entry):
+	int best_move = 0;
 	// Position repetition occurs:
-	if (ply && is_repetition())
+	if (ctx->ply && is_repetition(pos))
 	{
 		// Return draw score:
 		return 0;
 	}
 	// A hack from Pedro Catro to figure out if the current node is a PV node or not:
 	int pv_node = beta - alpha > 1;
-	// Reading the hash entry when not a root ply and not a PV node:
-	if (ply && (score = read_hash_entry(alpha, beta, depth)) != no_hash_entry && pv_node == 0)
+	// Move to search first (the hash move unless following the PV):
+	int hash_move = 0;
+	// Reading the hash entry (its score is used when not a root ply and not a PV node):
+	if ((score = read_hash_entry(ctx, alpha, beta, depth, &hash_move)) != no_hash_entry && ctx->ply && pv_node == 0)
 	{
 		// The move has already been searched (hence has a value)
 		// then return the score withou searching again:
 		return score;
 	}
-	// Every 2047 nodes:
-	if ((nodes & 2047) == 0)
+	// Every 2047 nodes (main thread only):
+	if ((ctx->nodes & 2047) == 0 && ctx->id == 0)
 	{
 		// "Listen" to the GUI/user input:
 		communicate();
@@ -3756,20 +6272,20 @@ static inline int negamax(int alpha, int beta, int depth)
 	if (depth == 0)
 	{
 		// Run the quiescence search:
-		return quiescence(alpha, beta);
+		return quiescence(ctx, alpha, beta);
 	}
 	// Too deep, hence there is an overflow of arrrays relying on max ply constant:
-	if (ply > max_ply - 1)
+	if (ctx->ply > max_ply - 1)
 	{
 		// Evaluate position:
-		return evaluate();
+		return evaluate_cached(ctx);
 	}
 	// Increment nodes count:
-	nodes++;
+	ctx->nodes++;
 	// Is king in check:
-	int in_check = is_square_attacked(
-			(side == white) ? get_ls1b_index(bitboards[K]) : get_ls1b_index(bitboards[k]),
-			side ^ 1);
+	int in_check = is_square_attacked(pos,
+			(pos->side == white) ? get_ls1b_index(pos->bitboards[K]) : get_ls1b_index(pos->bitboards[k]),
+			pos->side ^ 1);
 	// Increase search depth if the king has been exposed into a check:
 	if (in_check)
 	{
@@ -3779,34 +6295,37 @@ static inline int negamax(int alpha, int beta, int depth)
 	// Legal moves counter:
 	int legal_moves = 0;
 	// NULL move prunning:
-	if (depth >= 3 && in_check == 0 && ply)
+	if (depth >= 3 && in_check == 0 && ctx->ply)
 	{
-		// Preserve board state:
-		copy_board();
+		// Preserve the state the null move changes:
+		int enpassant_copy = pos->enpassant;
+		U64 hash_key_copy = pos->hash_key;
 		// Increment ply:
-		ply++;
+		ctx->ply++;
 		// Increment repetition index and store hash key:
-		repetition_index++;
-		repetition_table[repetition_index] = hash_key;
+		pos->repetition_index++;
+		pos->repetition_table[pos->repetition_index] = pos->hash_key;
 		// Hash enpassant if available:
-		if (enpassant != no_sq)
+		if (pos->enpassant != no_sq)
 		{
-			hash_key ^= enpassant_keys[enpassant];
+			pos->hash_key ^= enpassant_keys[pos->enpassant];
 		}
 		// Reset enpassant square:
-		enpassant = no_sq;
+		pos->enpassant = no_sq;
 		// Switch the side to move, literally giving the opponent an extra move:
-		side ^= 1;
+		pos->side ^= 1;
 		// Hash the side:
-		hash_key ^= side_key;
+		pos->hash_key ^= side_key;
 		// Search moves with reduced depth to find beta cutoffs:
-		score = -negamax(-beta, -beta + 1, depth - 1 - 2);
+		score = -negamax(ctx, -beta, -beta + 1, depth - 1 - 2);
 		// Decrement ply:
-		ply--;
+		ctx->ply--;
 		// Decrement repetition index:
-		repetition_index--;
+		pos->repetition_index--;
 		// Restore the board state:
-		restore_board();
+		pos->side ^= 1;
+		pos->enpassant = enpassant_copy;
+		pos->hash_key = hash_key_copy;
 		// If time is up:
 		if (stopped == 1)
 		{
@@ -3820,37 +6339,42 @@ static inline int negamax(int alpha, int beta, int depth)
 			return beta;
 		}
 	}
-	// Create a move list instance:
-	moves move_list[1];
-	// Generate the moves:
-	generate_moves(move_list);
 	// If following PV line:
-	if (follow_pv)
+	if (ctx->follow_pv)
 	{
-		// Enable PV move scoring:
-		enable_pv_scoring(move_list);
+		// Keep following PV only while its move can be played here:
+		ctx->follow_pv = 0;
+		if (is_pseudo_legal(pos, ctx->pv_table[0][ctx->ply]))
+		{
+			// Search PV move first:
+			hash_move = ctx->pv_table[0][ctx->ply];
+			ctx->follow_pv = 1;
+		}
 	}
-	// Sort the moves in the move list:
-	sort_moves(move_list);
+	// Create a move picker instance:
+	move_picker picker[1];
+	init_move_picker(ctx, picker, hash_move);
 	// Number of moves searched in a move list:
 	int moves_searched = 0;
-	// Loop over moves within a movelist:
-	for (int count = 0; count < move_list->count; count++)
+	// Current move:
+	int move;
+	// Loop over moves yielded by the move picker:
+	while ((move = next_move(ctx, picker)))
 	{
-		// Preserve the board state:
-		copy_board();
+		// Move undo information:
+		undo state[1];
 		// Increment the ply:
-		ply++;
+		ctx->ply++;
 		// Increment repetition index and store hash key:
-		repetition_index++;
-		repetition_table[repetition_index] = hash_key;
+		pos->repetition_index++;
+		pos->repetition_table[pos->repetition_index] = pos->hash_key;
 		// Make sure to make only legal moves:
-		if (make_move(move_list->moves[count], all_moves) == 0)
+		if (make_move(pos, move, all_moves, state) == 0)
 		{
 			// Decrement ply:
-			ply--;
+			ctx->ply--;
 			// Decrement repetition index:
-			repetition_index--;
+			pos->repetition_index--;
 			// Skip to the next move:
 			continue;
 		}
@@ -3860,16 +6384,16 @@ static inline int negamax(int alpha, int beta, int depth)
 		if (moves_searched == 0)
 		{
 			// Regular alpha beta search:
-			score = -negamax(-beta, -alpha, depth - 1);
+			score = -negamax(ctx, -beta, -alpha, depth - 1);
 		}
 		// LMR search:
 		else
 		{
 			// Condition to consider LMR (late move reduction):
-			if (moves_searched >= full_depth_moves && depth >= reduction_limit && in_check == 0 && get_move_capture(move_list->moves[count]) == 0 && get_move_promoted(move_list->moves[count]) == 0)
+			if (moves_searched >= full_depth_moves && depth >= reduction_limit && in_check == 0 && get_move_capture(move) == 0 && get_move_promoted(move) == 0)
 			{
 				// Search current move with reduced depth:
-				score = -negamax(-alpha - 1, -alpha, depth - 2);
+				score = -negamax(ctx, -alpha - 1, -alpha, depth - 2);
 			}
 			// Hack to ensure that full-depth search is done:
 			else
@@ -3883,7 +6407,7 @@ static inline int negamax(int alpha, int beta, int depth)
 				the rest of the moves are searched with the goal of proving that they are all bad.
 				It's possible to do this a bit faster than a search that worries that one
 				of the remaining moves might be good. */
-				score = -negamax(-alpha - 1, -alpha, depth - 1);
+				score = -negamax(ctx, -alpha - 1, -alpha, depth - 1);
 				/* If the algorithm finds out that it was wrong, and that one of the
 				subsequent moves was better than the first PV move, it has to search again,
 				in the normal alpha-beta manner.  This happens sometimes, and it's a waste of time,
@@ -3892,16 +6416,16 @@ static inline int negamax(int alpha, int beta, int depth)
 				if ((score > alpha) && (score < beta))
 				{
 					// Re-search the move that has failed to be proven bad:
-					score = -negamax(-beta, -alpha, depth - 1);
+					score = -negamax(ctx, -beta, -alpha, depth - 1);
 				}
 			}
 		}
 		// Decrement ply:
-		ply--;
+		ctx->ply--;
 		// Decrement repetition index:
-		repetition_index--;
+		pos->repetition_index--;
 		// Take move back:
-		restore_board();
+		unmake_move(pos, move, state);
 		// If time is up:
 		if (stopped == 1)
 		{
@@ -3916,35 +6440,37 @@ static inline int negamax(int alpha, int beta, int depth)
 			// Switch the hash flag from storing score for fail-low node
 			// to the one storing score for PV node:
 			hash_flag = hash_flag_exact;
+			// Remember the best move:
+			best_move = move;
 			// On quiet moves:
-			if (get_move_capture(move_list->moves[count]) == 0)
+			if (get_move_capture(move) == 0)
 			{
 				// Store history moves:
-				history_moves[get_move_piece(move_list->moves[count])][get_move_target(move_list->moves[count])] += depth;
+				ctx->history_moves[get_move_piece(move)][get_move_target(move)] += depth;
 			}
 			// PV node (move):
 			alpha = score;
 			// Write PV move:
-			pv_table[ply][ply] = move_list->moves[count];
+			ctx->pv_table[ctx->ply][ctx->ply] = move;
 			// Loop over next ply line:
-			for (int next_ply = ply + 1; next_ply < pv_length[ply + 1]; next_ply++)
+			for (int next_ply = ctx->ply + 1; next_ply < ctx->pv_length[ctx->ply + 1]; next_ply++)
 			{
 				// Copy move from deeper ply into a current plys line:
-				pv_table[ply][next_ply] = pv_table[ply + 1][next_ply];
+				ctx->pv_table[ctx->ply][next_ply] = ctx->pv_table[ctx->ply + 1][next_ply];
 			}
 			// Adjust PV length:
-			pv_length[ply] = pv_length[ply + 1];
+			ctx->pv_length[ctx->ply] = ctx->pv_length[ctx->ply + 1];
 			// Fail-hard beta cutoff:
 			if (score >= beta)
 			{
 				// Store hash entry with the score equal to beta:
-				write_hash_entry(beta, depth, hash_flag_beta);
+				write_hash_entry(ctx, beta, depth, hash_flag_beta, compact_move(move));
 				// On quiet moves:
-				if (get_move_capture(move_list->moves[count]) == 0)
+				if (get_move_capture(move) == 0)
 				{
 					// Store killer moves:
-					killer_moves[1][ply] = killer_moves[0][ply];
-					killer_moves[0][ply] = move_list->moves[count];
+					ctx->killer_moves[1][ctx->ply] = ctx->killer_moves[0][ctx->ply];
+					ctx->killer_moves[0][ctx->ply] = move;
 				}
 				// Node (moves) fails high:
 				return beta;
@@ -3958,7 +6484,7 @@ static inline int negamax(int alpha, int beta, int depth)
 		if (in_check)
 		{
 			// Return mating score (assuming closest distance to mate):
-			return -mate_value + ply;
+			return -mate_value + ctx->ply;
 		}
 		// King is not in check:
 		else
@@ -3968,33 +6494,85 @@ static inline int negamax(int alpha, int beta, int depth)
 		}
 	}
 	// Store hash entry with the score equal to alpha:
-	write_hash_entry(alpha, depth, hash_flag);
+	write_hash_entry(ctx, alpha, depth, hash_flag, compact_move(best_move));
 	// Node (move) fails low:
 	return alpha;
 }
 
-// Search position for the best move:
-void search_position(int depth)
+// Lazy SMP depth skipping pattern for helper threads (borrowed from Stockfish 9):
+const int skip_size[20] = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+const int skip_phase[20] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+// Sum up the nodes searched by all the threads:
+U64 get_total_nodes()
+{
+	// Total nodes counter:
+	U64 total_nodes = 0;
+	// Loop over search threads:
+	for (int id = 0; id < thread_count; id++)
+	{
+		// Accumulate thread nodes:
+		total_nodes += search_threads[id].nodes;
+	}
+	// Return total nodes:
+	return total_nodes;
+}
+
+// Sum up the pawn hash probes and hits of all the search threads:
+void get_pawn_hash_stats(U64 *probes, U64 *hits)
+{
+	// Reset counters:
+	*probes = *hits = 0;
+	// Loop over search threads:
+	for (int id = 0; id < thread_count; id++)
+	{
+		// Accumulate thread counters:
+		*probes += search_threads[id].pawn_hash.probes;
+		*hits += search_threads[id].pawn_hash.hits;
+	}
+}
+
+// Sum up the evaluation cache probes and hits of all the search threads:
+void get_eval_cache_stats(U64 *probes, U64 *hits)
+{
+	// Reset counters:
+	*probes = *hits = 0;
+	// Loop over search threads:
+	for (int id = 0; id < thread_count; id++)
+	{
+		// Accumulate thread counters:
+		*probes += search_threads[id].eval_probes;
+		*hits += search_threads[id].eval_hits;
+	}
+}
+
+// Print the statistics of the last search (UCI <stats> command):
+void print_search_stats()
+{
+	// Gather cache statistics:
+	U64 pawn_probes, pawn_hits, eval_probes, eval_hits;
+	get_pawn_hash_stats(&pawn_probes, &pawn_hits);
+	get_eval_cache_stats(&eval_probes, &eval_hits);
+	// Print them:
+	printf("Nodes searched  : %lld\n", get_total_nodes());
+	printf("Hash table      : %dMB on %s, hashfull %d\n", hash_mb, page_mode_names[hash_page_mode], hash_full());
+	printf("Pawn hash       : %lld probes, %lld hits (%.1f%%)\n", pawn_probes, pawn_hits, pawn_probes ? 100.0 * pawn_hits / pawn_probes : 0.0);
+	if (eval_cache_entries)
+		printf("Eval cache      : %dMB, %lld probes, %lld hits (%.1f%%)\n", eval_cache_mb, eval_probes, eval_hits, eval_probes ? 100.0 * eval_hits / eval_probes : 0.0);
+	else
+		printf("Eval cache      : disabled\n");
+}
+
+// Iterative deepening (run by every search thread):
+void iterative_deepening(search_context *ctx)
 {
 	// Define the best score variable:
 	int score = 0;
-	// Reset nodes counter:
-	nodes = 0;
-	// Reset "time is up" flag:
-	stopped = 0;
-	// Reset PV flags:
-	follow_pv = 0;
-	score_pv = 0;
-	// Clear all the helper structures for search:
-	memset(killer_moves, 0, sizeof(killer_moves));
-	memset(history_moves, 0, sizeof(history_moves));
-	memset(pv_table, 0, sizeof(pv_table));
-	memset(pv_length, 0, sizeof(pv_length));
 	// Define the initial alpha and beta window:
 	int alpha = -infinity;
 	int beta = infinity;
 	// Iterative deepining:
-	for (int current_depth = 1; current_depth <= depth; current_depth++)
+	for (int current_depth = 1; current_depth <= ctx->depth; current_depth++)
 	{
 		// If time is up:
 		if (stopped == 1)
@@ -4002,10 +6580,21 @@ void search_position(int depth)
 			// Stop calculating and return the best move so far:
 			break;
 		}
+		// Helper threads skip some depths to spread over the tree:
+		if (ctx->id)
+		{
+			// Initialize skipping pattern index:
+			int index = (ctx->id - 1) % 20;
+			// Skip current depth:
+			if (((current_depth + skip_phase[index]) / skip_size[index]) % 2)
+			{
+				continue;
+			}
+		}
 		// Enable follow PV flag:
-		follow_pv = 1;
+		ctx->follow_pv = 1;
 		// Find the best move with a given position:
-		score = negamax(alpha, beta, current_depth);
+		score = negamax(ctx, alpha, beta, current_depth);
 		// Fell outside the window, so try again with a full-width window (and the same depth):
 		if ((score <= alpha) || (score >= beta))
 		{
@@ -4016,51 +6605,907 @@ void search_position(int depth)
 		// Setup the window for the next iteration:
 		alpha = score - 50;
 		beta = score + 50;
-
+		// Only the main thread talks to the GUI:
+		if (ctx->id)
+		{
+			continue;
+		}
 		// PV is available:
-		if (pv_length[0])
+		if (ctx->pv_length[0])
 		{
+			// Combined nodes of all the threads:
+			U64 nodes = get_total_nodes();
+			// Time spent on search:
+			int time_spent = get_time_ms() - starttime;
+			// Nodes per second:
+			U64 nps = time_spent ? nodes * 1000 / time_spent : 0;
 			// Send the score to GUI through UCI command:
 			if (score > -mate_value && score < -mate_score)
 			{
-				printf("info score mate %d depth %d nodes %lld time %d pv ", -(score + mate_value) / 2 - 1, current_depth, nodes, get_time_ms() - starttime);
+				printf("info score mate %d depth %d nodes %lld nps %lld time %d hashfull %d pv ", -(score + mate_value) / 2 - 1, current_depth, nodes, nps, time_spent, hash_full());
 			}
 			else if (score > mate_score && score < mate_value)
 			{
-				printf("info score mate %d depth %d nodes %lld time %d pv ", (mate_value - score) / 2 + 1, current_depth, nodes, get_time_ms() - starttime);
+				printf("info score mate %d depth %d nodes %lld nps %lld time %d hashfull %d pv ", (mate_value - score) / 2 + 1, current_depth, nodes, nps, time_spent, hash_full());
 			}
 			else
 			{
-				printf("info score cp %d depth %d nodes %lld time %d pv ", score, current_depth, nodes, get_time_ms() - starttime);
+				printf("info score cp %d depth %d nodes %lld nps %lld time %d hashfull %d pv ", score, current_depth, nodes, nps, time_spent, hash_full());
 			}
 			// Loop over the moves within a PV line:
-			for (int count = 0; count < pv_length[0]; count++)
+			for (int count = 0; count < ctx->pv_length[0]; count++)
 			{
 				// Print the move:
-				print_move(pv_table[0][count]);
+				print_move(ctx->pv_table[0][count]);
 				printf(" ");
 			}
 			// Print a new line:
 			printf("\n");
 		}
 	}
+}
+
+// Helper thread entry point:
+void *helper_thread(void *arg)
+{
+	// Search with the helper thread context:
+	iterative_deepening((search_context *)arg);
+	// Nothing to return:
+	return NULL;
+}
+
+// Search position for the best move:
+void search_position(position *pos, int depth)
+{
+	// Helper threads handles:
+	pthread_t helpers[max_threads];
+	// Reset "time is up" flag:
+	stopped = 0;
+	// Age the hash entries of previous searches:
+	new_search_generation();
+	// Loop over search threads:
+	for (int id = 0; id < thread_count; id++)
+	{
+		// Initialize search context:
+		search_context *ctx = &search_threads[id];
+		// Search a private copy of the given position:
+		ctx->pos = *pos;
+		// Start from exact NNUE accumulators (the given position may have been changed without them):
+		if (use_nnue)
+			refresh_accumulators(&ctx->pos);
+		// Set thread id and search depth:
+		ctx->id = id;
+		ctx->depth = depth;
+		// Reset ply and nodes counter:
+		ctx->ply = 0;
+		ctx->nodes = 0;
+		// Reset PV flags:
+		ctx->follow_pv = 0;
+		// Allocate the pawn hash table on first use and reset its statistics:
+		if (ctx->pawn_hash.entries == NULL)
+			ctx->pawn_hash.entries = calloc(pawn_hash_entries, sizeof(pawn_entry));
+		ctx->pawn_hash.probes = ctx->pawn_hash.hits = 0;
+		// Reset evaluation cache statistics:
+		ctx->eval_probes = ctx->eval_hits = 0;
+		// Clear all the helper structures for search:
+		memset(ctx->killer_moves, 0, sizeof(ctx->killer_moves));
+		memset(ctx->history_moves, 0, sizeof(ctx->history_moves));
+		memset(ctx->pv_table, 0, sizeof(ctx->pv_table));
+		memset(ctx->pv_length, 0, sizeof(ctx->pv_length));
+		// Helper threads get slightly perturbed history scores to vary their move ordering:
+		if (id)
+		{
+			// Loop over pieces and squares:
+			for (int piece = P; piece <= k; piece++)
+			{
+				for (int square = 0; square < 64; square++)
+				{
+					// Small deterministic noise depending on thread id:
+					ctx->history_moves[piece][square] = ((unsigned)(id * 2654435761u) ^ ((piece * 64 + square) * 40503u)) >> 29;
+				}
+			}
+		}
+	}
+	// Launch helper threads:
+	for (int id = 1; id < thread_count; id++)
+	{
+		// Start helper thread:
+		pthread_create(&helpers[id], NULL, helper_thread, &search_threads[id]);
+	}
+	// Search with the main thread:
+	iterative_deepening(&search_threads[0]);
+	// Tell helper threads to stop:
+	stopped = 1;
+	// Wait for helper threads to finish:
+	for (int id = 1; id < thread_count; id++)
+	{
+		// Join helper thread:
+		pthread_join(helpers[id], NULL);
+	}
 	// Best move command:
 	printf("bestmove ");
-	print_move(pv_table[0][0]);
+	print_move(search_threads[0].pv_table[0][0]);
+	printf("\n");
+}
+
+/******************************************************************************\
+================================= SPEED TEST ===================================
+\******************************************************************************/
+
+// Speed test perft positions:
+char *speed_test_fens[] = {start_position, tricky_position};
+
+// Speed test perft depths:
+const int speed_test_depths[] = {5, 4};
+
+// Speed test search depth:
+#define speed_test_search_depth 7
+
+// Measure perft and search throughput with the currently selected backends:
+void speed_test_run(int depth_offset)
+{
+	// Test position:
+	position pos[1];
+	// Loop over perft positions:
+	for (int index = 0; index < 2; index++)
+	{
+		// Set up the position:
+		parse_fen(pos, speed_test_fens[index]);
+		// Run perft:
+		int start = get_time_ms();
+		U64 nodes = perft_driver(pos, speed_test_depths[index] + depth_offset);
+		int time_spent = get_time_ms() - start;
+		// Print perft throughput:
+		printf("perft %d %-60s %10lld nodes %6d ms %8lld knps\n", speed_test_depths[index] + depth_offset, speed_test_fens[index], nodes, time_spent, nodes / (time_spent + 1));
+	}
+	// Set up search position:
+	parse_fen(pos, tricky_position);
+	// Search from scratch without time control:
+	clear_hash_table();
+	timeset = 0;
+	starttime = get_time_ms();
+	// Search position:
+	search_position(pos, speed_test_search_depth);
+	// Print search throughput:
+	int time_spent = get_time_ms() - starttime;
+	printf("search %d %-59s %10lld nodes %6d ms %8lld knps\n", speed_test_search_depth, tricky_position, get_total_nodes(), time_spent, get_total_nodes() / (time_spent + 1));
+}
+
+// Check unmake_move against copy_board/restore_board and compare their perft throughput:
+void speed_test_unmake()
+{
+	// Test position:
+	position pos[1];
+	// Loop over perft positions:
+	for (int index = 0; index < 2; index++)
+	{
+		// Perft depth:
+		int depth = speed_test_depths[index];
+		// Check that both approaches agree:
+		U64 mismatches = 0;
+		parse_fen(pos, speed_test_fens[index]);
+		U64 nodes = perft_check_unmake(pos, depth, &mismatches);
+		printf("check  %d %-60s %10lld nodes %6lld mismatches\n", depth, speed_test_fens[index], nodes, mismatches);
+		// Snapshot approach:
+		int start = get_time_ms();
+		nodes = perft_driver_snapshot(pos, depth);
+		int time_spent = get_time_ms() - start;
+		printf("copy   %d %-60s %10lld nodes %6d ms %8lld knps\n", depth, speed_test_fens[index], nodes, time_spent, nodes / (time_spent + 1));
+		// Unmake approach:
+		start = get_time_ms();
+		nodes = perft_driver(pos, depth);
+		time_spent = get_time_ms() - start;
+		printf("unmake %d %-60s %10lld nodes %6d ms %8lld knps\n", depth, speed_test_fens[index], nodes, time_spent, nodes / (time_spent + 1));
+	}
+}
+
+// Compare perft with and without the perft hash table:
+void speed_test_perft_hash()
+{
+	// Test position:
+	position pos[1];
+	// Preserve perft hash size:
+	int mb = perft_hash_mb;
+	// Loop over perft positions:
+	for (int index = 0; index < 2; index++)
+	{
+		// One ply deeper than the other speed tests:
+		int depth = speed_test_depths[index] + 1;
+		parse_fen(pos, speed_test_fens[index]);
+		// Plain perft:
+		int start = get_time_ms();
+		U64 nodes = perft_driver(pos, depth);
+		int plain_time = get_time_ms() - start;
+		printf("plain  %d %-60s %10lld nodes %6d ms %8lld knps\n", depth, speed_test_fens[index], nodes, plain_time, nodes / (plain_time + 1));
+		// Hashed perft (64MB unless a size was set):
+		init_perft_hash_table(mb ? mb : 64);
+		perft_stats stats[1] = {{0, 0}};
+		start = get_time_ms();
+		nodes = perft_driver_hashed(pos, depth, stats);
+		int hashed_time = get_time_ms() - start;
+		printf("hashed %d %-60s %10lld nodes %6d ms %8lld knps\n", depth, speed_test_fens[index], nodes, hashed_time, nodes / (hashed_time + 1));
+		printf("       %dMB, hit rate %.1f%%, speedup %.2fx\n", perft_hash_mb, stats->probes ? 100.0 * stats->hits / stats->probes : 0.0, (double)(plain_time + 1) / (hashed_time + 1));
+	}
+	// Restore perft hash size:
+	init_perft_hash_table(mb);
+}
+
+// Bulk counting perft positions (empty_board is left out: it has no kings to generate legal moves for):
+char *bulk_test_fens[] = {start_position, tricky_position, killer_position, cmk_position, repetitions};
+
+// Bulk counting perft depths:
+const int bulk_test_depths[] = {6, 5, 5, 5, 6};
+
+// Compare perft with and without bulk counting at the frontier:
+void speed_test_bulk()
+{
+	// Test position:
+	position pos[1];
+	// Preserve bulk counting switch:
+	int bulk = perft_bulk_counting;
+	// Loop over perft positions:
+	for (int index = 0; index < 5; index++)
+	{
+		// Perft depth:
+		int depth = bulk_test_depths[index];
+		parse_fen(pos, bulk_test_fens[index]);
+		// Make and take back every frontier move:
+		perft_bulk_counting = 0;
+		int start = get_time_ms();
+		U64 nodes = perft_driver(pos, depth);
+		int make_time = get_time_ms() - start;
+		printf("make   %d %-66s %10lld nodes %6d ms %8lld knps\n", depth, bulk_test_fens[index], nodes, make_time, nodes / (make_time + 1));
+		// Count the frontier move lists:
+		perft_bulk_counting = 1;
+		start = get_time_ms();
+		nodes = perft_driver(pos, depth);
+		int bulk_time = get_time_ms() - start;
+		printf("bulk   %d %-66s %10lld nodes %6d ms %8lld knps\n", depth, bulk_test_fens[index], nodes, bulk_time, nodes / (bulk_time + 1));
+	}
+	// Restore bulk counting switch:
+	perft_bulk_counting = bulk;
+}
+
+// Compare the portable and the hardware backends ("sliders" compares magics and PEXT, "unmake" the ways to take moves back, "legal" the move generators, "perfthash" perft hashing, "bulk" frontier bulk counting):
+void speed_test(char *mode)
+{
+	// Compare perft with and without bulk counting:
+	if (strstr(mode, "bulk"))
+	{
+		printf("\nPerft: make/unmake at the frontier vs bulk counting (legal generator)\n\n");
+		// Preserve selected generator (bulk counting needs the legal one):
+		int legal = legal_move_generation;
+		legal_move_generation = 1;
+		speed_test_bulk();
+		legal_move_generation = legal;
+	}
+	// Compare perft with and without the perft hash table:
+	else if (strstr(mode, "perfthash"))
+	{
+		printf("\nPerft: plain vs perft hash table\n\n");
+		speed_test_perft_hash();
+	}
+	// Compare the pseudo legal and the legal move generators:
+	else if (strstr(mode, "legal"))
+	{
+		// Preserve selected generator and bulk counting (only the legal generator can bulk count):
+		int legal = legal_move_generation, bulk = perft_bulk_counting;
+		perft_bulk_counting = 0;
+		// Pseudo legal generator:
+		legal_move_generation = 0;
+		printf("\nMove generator: pseudo legal (king attack test in make_move)\n\n");
+		speed_test_run(0);
+		// Legal generator:
+		legal_move_generation = 1;
+		printf("\nMove generator: legal (pin and checker masks)\n\n");
+		speed_test_run(0);
+		legal_move_generation = legal, perft_bulk_counting = bulk;
+	}
+	// Compare copy_board/restore_board and unmake_move:
+	else if (strstr(mode, "unmake"))
+	{
+		printf("\nTaking moves back: copy_board/restore_board vs unmake_move\n\n");
+		// Take every move back (the snapshot driver does not bulk count):
+		int bulk = perft_bulk_counting;
+		perft_bulk_counting = 0;
+		speed_test_unmake();
+		perft_bulk_counting = bulk;
+	}
+	// Compare slider attack backends:
+	else if (strstr(mode, "sliders"))
+	{
+		// Preserve detected backend:
+		int detected_pext = hardware_pext;
+		// Magic bitboards backend:
+		hardware_pext = 0;
+		printf("\nSlider backend: magic bitboards\n\n");
+		speed_test_run(1);
+		// PEXT backend:
+		if (detected_pext)
+		{
+			hardware_pext = 1;
+			printf("\nSlider backend: PEXT\n\n");
+			speed_test_run(1);
+		}
+		else
+			printf("\nSlider backend: PEXT not available (no BMI2)\n");
+	}
+	// Compare bit counting/scanning backends:
+	else
+	{
+		// Preserve detected backends:
+		int popcnt = hardware_popcnt, bitscan = hardware_bitscan;
+		// Portable backend:
+		hardware_popcnt = hardware_bitscan = 0;
+		printf("\nBit backend: portable (SWAR popcount, De Bruijn bitscan)\n\n");
+		speed_test_run(0);
+		// Hardware backend:
+		hardware_popcnt = popcnt, hardware_bitscan = bitscan;
+		printf("\nBit backend: detected (popcnt: %s, bitscan: %s)\n\n", popcnt ? "hardware" : "portable", bitscan ? "hardware" : "portable");
+		speed_test_run(0);
+	}
 	printf("\n");
 }
 
+// Bench positions:
+char *bench_fens[] = {
+		start_position,
+		tricky_position,
+		killer_position,
+		cmk_position,
+		repetitions,
+		"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+		"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+		"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+		"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+		"r1bq1rk1/pp2bppp/2n2n2/3p4/3P4/2NB1N2/PP3PPP/R1BQ1RK1 w - - 0 10",
+		"6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+		"8/8/4k3/3p4/3P4/4K3/8/8 w - - 0 1"};
+
+// Bench defaults:
+#define bench_depth 8
+#define bench_threads 1
+#define bench_hash 16
+
+// Search the bench positions to a fixed depth with a cleared TT (total nodes is the search signature):
+void bench(int depth, int threads, int mb)
+{
+	// Preserve the number of threads:
+	int threads_copy = thread_count;
+	// Clamp depth and hash size:
+	depth = (depth > 0) ? depth : bench_depth;
+	mb = (mb < 4) ? 4 : (mb > max_hash) ? max_hash : mb;
+	// Set up threads and hash size:
+	thread_count = (threads < 1) ? 1 : (threads > max_threads) ? max_threads : threads;
+	init_hash_table(mb);
+	// Don't let pending input cut the searches short:
+	listen_input = 0;
+	// Bench position:
+	position pos[1];
+	// Bench totals:
+	U64 total_nodes = 0, pawn_probes = 0, pawn_hits = 0, eval_probes = 0, eval_hits = 0;
+	int total_time = 0;
+	// Loop over bench positions:
+	int count = sizeof(bench_fens) / sizeof(char *);
+	for (int index = 0; index < count; index++)
+	{
+		printf("\nPosition %d/%d: %s\n", index + 1, count, bench_fens[index]);
+		// Set up the position:
+		parse_fen(pos, bench_fens[index]);
+		// Search from scratch without time control:
+		clear_hash_table();
+		timeset = 0;
+		starttime = get_time_ms();
+		search_position(pos, depth);
+		// Accumulate nodes and time:
+		total_nodes += get_total_nodes();
+		total_time += get_time_ms() - starttime;
+		// Accumulate pawn hash statistics:
+		U64 probes, hits;
+		get_pawn_hash_stats(&probes, &hits);
+		pawn_probes += probes;
+		pawn_hits += hits;
+		// Accumulate evaluation cache statistics:
+		get_eval_cache_stats(&probes, &hits);
+		eval_probes += probes;
+		eval_hits += hits;
+	}
+	// Restore input and threads:
+	listen_input = 1;
+	thread_count = threads_copy;
+	// Print bench results:
+	printf("\n===========================\n");
+	printf("Total time (ms) : %d\n", total_time);
+	printf("Nodes searched  : %lld\n", total_nodes);
+	printf("Nodes/second    : %lld\n", total_nodes * 1000 / (total_time + 1));
+	printf("Pawn hash hits  : %.1f%%\n", pawn_probes ? 100.0 * pawn_hits / pawn_probes : 0.0);
+	printf("Eval cache hits : %.1f%%\n", eval_probes ? 100.0 * eval_hits / eval_probes : 0.0);
+}
+
+/******************************************************************************\
+==================================== TUNING ====================================
+\******************************************************************************/
+
+/*
+	Texel tuning: fit the evaluation weights to the results of the games a set
+	of quiet positions comes from by minimizing
+
+		E = 1/N * sum (result - sigmoid(K * eval))^2
+
+	with sigmoid(x) = 1 / (1 + 10^(-x / 400)), result 1, 0.5 or 0 for white.
+
+	Apart from the game phase (taken from the current material weights), the
+	handcrafted evaluation is linear in its weights. So each position is
+	traced once while loading: trace_evaluation is a copy of evaluate that
+	counts how often every weight is applied (white minus black, opening and
+	endgame counts already interpolated by the game phase). The evaluation of
+	a position is then the dot product of its few non zero terms with the
+	weights, which keeps the loss and gradient passes memory bound and split
+	between the threads.
+
+	Positions come from an EPD file, one per line, with the result either as
+	a game result ("1-0", "0-1", "1/2-1/2") or between brackets ([1.0], [0.5],
+	[0.0]). Tuned tables are printed as C source.
+*/
+
+// Tuned weights (one per evaluation constant, opening and endgame apart):
+enum
+{
+	tune_material = 0,
+	tune_positional = tune_material + 2 * 6,
+	tune_double_pawn = tune_positional + 2 * 6 * 64,
+	tune_isolated_pawn = tune_double_pawn + 2,
+	tune_passed_pawn = tune_isolated_pawn + 2,
+	tune_semi_open_file = tune_passed_pawn + 8,
+	tune_open_file = tune_semi_open_file + 1,
+	tune_bishop_mobility = tune_open_file + 1,
+	tune_queen_mobility = tune_bishop_mobility + 2,
+	tune_king_shield = tune_queen_mobility + 2,
+	tune_weights = tune_king_shield + 1
+};
+
+// Tuning defaults:
+#define tune_epochs 500
+#define tune_rate 1.0
+
+// Weights being tuned:
+double tune_weight[tune_weights];
+
+// Tuning positions (terms of position n are tune_offsets[n] to tune_offsets[n + 1]):
+int tune_positions;
+float *tune_results;
+U64 *tune_offsets;
+
+// Tuning terms (weight index and coefficient):
+unsigned short *tune_indices;
+float *tune_coefficients;
+
+// Load the current evaluation constants into the tuned weights:
+void init_tune_weights()
+{
+	for (int phase = opening; phase <= endgame; phase++)
+	{
+		for (int type = PAWN; type <= KING; type++)
+		{
+			tune_weight[tune_material + phase * 6 + type] = material_score[phase][type];
+			for (int square = 0; square < 64; square++)
+				tune_weight[tune_positional + (phase * 6 + type) * 64 + square] = positional_score[phase][type][square];
+		}
+	}
+	tune_weight[tune_double_pawn + opening] = double_pawn_penalty_opening;
+	tune_weight[tune_double_pawn + endgame] = double_pawn_penalty_endgame;
+	tune_weight[tune_isolated_pawn + opening] = isolated_pawn_penalty_opening;
+	tune_weight[tune_isolated_pawn + endgame] = isolated_pawn_penalty_endgame;
+	for (int rank = 0; rank < 8; rank++)
+		tune_weight[tune_passed_pawn + rank] = passed_pawn_bonus[rank];
+	tune_weight[tune_semi_open_file] = semi_open_file_score;
+	tune_weight[tune_open_file] = open_file_score;
+	tune_weight[tune_bishop_mobility + opening] = bishop_mobility_opening;
+	tune_weight[tune_bishop_mobility + endgame] = bishop_mobility_endgame;
+	tune_weight[tune_queen_mobility + opening] = queen_mobility_opening;
+	tune_weight[tune_queen_mobility + endgame] = queen_mobility_endgame;
+	tune_weight[tune_king_shield] = king_shield_bonus;
+}
+
+// Count the weights evaluate applies to a position [weight][game phase] (white point of view):
+void trace_evaluation(position *pos, int trace[tune_weights][2])
+{
+	// Start from no terms:
+	memset(trace, 0, sizeof(int) * tune_weights * 2);
+	// Pawn structure files:
+	pawn_entry pawns[1];
+	evaluate_pawns(pos, pawns);
+	// Loop over the pieces bitboards:
+	for (int piece = P; piece <= k; piece++)
+	{
+		// Piece type and sign (white adds, black subtracts):
+		int type = piece % 6, side = (piece <= K) ? white : black, sign = (side == white) ? 1 : -1;
+		U64 bitboard = pos->bitboards[piece];
+		while (bitboard)
+		{
+			int square = get_ls1b_index(bitboard);
+			// Terms that count the same in both game phases:
+			int shared[4], amount[4], count = 0;
+			// Material and positional scores (mirrored for black):
+			for (int phase = opening; phase <= endgame; phase++)
+			{
+				trace[tune_material + phase * 6 + type][phase] += sign;
+				trace[tune_positional + (phase * 6 + type) * 64 + ((side == white) ? square : mirror_scores[square])][phase] += sign;
+			}
+			switch (type)
+			{
+			case PAWN:
+			{
+				// Double pawns:
+				int double_pawns = count_bits(pos->bitboards[piece] & file_masks[square]);
+				if (double_pawns > 1)
+				{
+					trace[tune_double_pawn + opening][opening] += sign * (double_pawns - 1);
+					trace[tune_double_pawn + endgame][endgame] += sign * (double_pawns - 1);
+				}
+				// Isolated pawn:
+				if ((pos->bitboards[piece] & isolated_masks[square]) == 0)
+				{
+					trace[tune_isolated_pawn + opening][opening] += sign;
+					trace[tune_isolated_pawn + endgame][endgame] += sign;
+				}
+				// Passed pawn:
+				if (((side == white) ? white_passed_masks[square] & pos->bitboards[p] : black_passed_masks[square] & pos->bitboards[P]) == 0)
+					shared[count] = tune_passed_pawn + get_rank[square], amount[count++] = sign;
+				break;
+			}
+			case BISHOP:
+				// Mobility:
+				trace[tune_bishop_mobility + opening][opening] += sign * (count_bits(get_bishop_attacks(square, pos->occupancies[both])) - bishop_unit);
+				trace[tune_bishop_mobility + endgame][endgame] += sign * (count_bits(get_bishop_attacks(square, pos->occupancies[both])) - bishop_unit);
+				break;
+			case QUEEN:
+				// Mobility:
+				trace[tune_queen_mobility + opening][opening] += sign * (count_bits(get_queen_attacks(square, pos->occupancies[both])) - queen_unit);
+				trace[tune_queen_mobility + endgame][endgame] += sign * (count_bits(get_queen_attacks(square, pos->occupancies[both])) - queen_unit);
+				break;
+			case ROOK:
+			case KING:
+				// Semi open and open files (a bonus for rooks, a penalty for kings):
+				if (pawns->semi_open_files[side] & (1 << (square & 7)))
+					shared[count] = tune_semi_open_file, amount[count++] = (type == ROOK) ? sign : -sign;
+				if (pawns->open_files & (1 << (square & 7)))
+					shared[count] = tune_open_file, amount[count++] = (type == ROOK) ? sign : -sign;
+				// King shield:
+				if (type == KING)
+					shared[count] = tune_king_shield, amount[count++] = sign * count_bits(king_attacks[square] & pos->occupancies[side]);
+				break;
+			}
+			// Shared terms:
+			for (int index = 0; index < count; index++)
+			{
+				trace[shared[index]][opening] += amount[index];
+				trace[shared[index]][endgame] += amount[index];
+			}
+			pop_bit(bitboard, square);
+		}
+	}
+}
+
+// Share of the opening score in the evaluation of a position (the endgame score takes the rest):
+double trace_phase(position *pos)
+{
+	if (pos->phase_score > opening_phase_score)
+		return 1.0;
+	if (pos->phase_score < endgame_phase_score)
+		return 0.0;
+	return (double)pos->phase_score / opening_phase_score;
+}
+
+// Parse the result of an EPD line (white point of view, returns 0 without one):
+int parse_tune_result(char *line, float *result)
+{
+	char *bracket = strchr(line, '[');
+	if (strstr(line, "1/2-1/2"))
+		*result = 0.5f;
+	else if (strstr(line, "1-0"))
+		*result = 1.0f;
+	else if (strstr(line, "0-1"))
+		*result = 0.0f;
+	else if (bracket)
+		*result = (float)atof(bracket + 1);
+	else
+		return 0;
+	return 1;
+}
+
+// Free the tuning positions:
+void free_tune_positions()
+{
+	free(tune_results);
+	free(tune_offsets);
+	free(tune_indices);
+	free(tune_coefficients);
+	tune_results = NULL, tune_offsets = NULL, tune_indices = NULL, tune_coefficients = NULL;
+	tune_positions = 0;
+}
+
+// Load and trace the positions of an EPD file (returns the number of positions):
+int load_tune_positions(char *path)
+{
+	free_tune_positions();
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return 0;
+	// Growing buffers:
+	int position_capacity = 1 << 16;
+	U64 term_capacity = 1 << 22, terms = 0;
+	tune_results = malloc(sizeof(float) * position_capacity);
+	tune_offsets = malloc(sizeof(U64) * (position_capacity + 1));
+	tune_indices = malloc(sizeof(unsigned short) * term_capacity);
+	tune_coefficients = malloc(sizeof(float) * term_capacity);
+	// Position and its trace:
+	position *pos = malloc(sizeof(position));
+	int (*trace)[2] = malloc(sizeof(int) * tune_weights * 2);
+	// Evaluations that do not match their trace (the copy fell behind evaluate):
+	int mismatches = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), file))
+	{
+		// Skip lines without a result:
+		float result;
+		if (!parse_tune_result(line, &result))
+			continue;
+		// Grow the buffers:
+		if (tune_positions == position_capacity)
+		{
+			position_capacity *= 2;
+			tune_results = realloc(tune_results, sizeof(float) * position_capacity);
+			tune_offsets = realloc(tune_offsets, sizeof(U64) * (position_capacity + 1));
+		}
+		if (terms + tune_weights > term_capacity)
+		{
+			term_capacity *= 2;
+			tune_indices = realloc(tune_indices, sizeof(unsigned short) * term_capacity);
+			tune_coefficients = realloc(tune_coefficients, sizeof(float) * term_capacity);
+		}
+		// Trace the position:
+		parse_fen(pos, line);
+		trace_evaluation(pos, trace);
+		double phase = trace_phase(pos), traced = 0.0;
+		// Keep the non zero terms:
+		tune_offsets[tune_positions] = terms;
+		for (int weight = 0; weight < tune_weights; weight++)
+		{
+			double coefficient = trace[weight][opening] * phase + trace[weight][endgame] * (1.0 - phase);
+			if (coefficient == 0.0)
+				continue;
+			tune_indices[terms] = weight;
+			tune_coefficients[terms++] = (float)coefficient;
+			traced += coefficient * tune_weight[weight];
+		}
+		tune_results[tune_positions++] = result;
+		// Check the trace (evaluate rounds toward zero):
+		int score = evaluate(pos, NULL);
+		if (!use_nnue && abs(((pos->side == white) ? score : -score) - (int)traced) > 1)
+			mismatches++;
+	}
+	tune_offsets[tune_positions] = terms;
+	fclose(file);
+	free(trace);
+	free(pos);
+	// Report the data set:
+	printf("Loaded %d positions, %.1f terms per position\n", tune_positions, tune_positions ? (double)terms / tune_positions : 0.0);
+	if (mismatches)
+		printf("Warning: %d positions evaluate differently from their trace\n", mismatches);
+	return tune_positions;
+}
+
+// Tuning worker (a contiguous slice of the positions):
+typedef struct
+{
+	int first, last;
+	// Sigmoid scaling (K * ln(10) / 400):
+	double scaling;
+	// Also compute the gradient:
+	int gradient;
+	// Slice loss and gradient sums:
+	double loss;
+	double grad[tune_weights];
+} tune_worker;
+
+// Loss (and gradient) over a slice of the positions:
+void *tune_worker_thread(void *arg)
+{
+	tune_worker *worker = (tune_worker *)arg;
+	worker->loss = 0.0;
+	if (worker->gradient)
+		memset(worker->grad, 0, sizeof(worker->grad));
+	for (int index = worker->first; index < worker->last; index++)
+	{
+		// Evaluation (dot product of the terms with the weights):
+		U64 first = tune_offsets[index], last = tune_offsets[index + 1];
+		double score = 0.0;
+		for (U64 term = first; term < last; term++)
+			score += tune_coefficients[term] * tune_weight[tune_indices[term]];
+		// Squared error of the predicted result:
+		double sigmoid = 1.0 / (1.0 + exp(-worker->scaling * score));
+		double error = sigmoid - tune_results[index];
+		worker->loss += error * error;
+		// Error slope with respect to every applied weight (constant factors applied by the caller):
+		if (worker->gradient)
+		{
+			double slope = error * sigmoid * (1.0 - sigmoid);
+			for (U64 term = first; term < last; term++)
+				worker->grad[tune_indices[term]] += slope * tune_coefficients[term];
+		}
+	}
+	return NULL;
+}
+
+// Mean loss over all positions (fills the gradient when given one):
+double tune_loss(double k, int threads, double *grad)
+{
+	// Split the positions between the threads (the calling thread takes the first slice):
+	tune_worker *workers = malloc(sizeof(tune_worker) * threads);
+	pthread_t handles[max_threads];
+	for (int id = 0; id < threads; id++)
+	{
+		workers[id].first = (int)((long)tune_positions * id / threads);
+		workers[id].last = (int)((long)tune_positions * (id + 1) / threads);
+		workers[id].scaling = k * 2.302585092994046 / 400.0;
+		workers[id].gradient = (grad != NULL);
+	}
+	for (int id = 1; id < threads; id++)
+		pthread_create(&handles[id], NULL, tune_worker_thread, &workers[id]);
+	tune_worker_thread(&workers[0]);
+	for (int id = 1; id < threads; id++)
+		pthread_join(handles[id], NULL);
+	// Sum the slices:
+	double loss = 0.0;
+	if (grad)
+		memset(grad, 0, sizeof(double) * tune_weights);
+	for (int id = 0; id < threads; id++)
+	{
+		loss += workers[id].loss;
+		if (grad)
+			for (int weight = 0; weight < tune_weights; weight++)
+				grad[weight] += workers[id].grad[weight];
+	}
+	// Mean loss and its gradient:
+	if (grad)
+		for (int weight = 0; weight < tune_weights; weight++)
+			grad[weight] *= 2.0 * workers[0].scaling / tune_positions;
+	free(workers);
+	return loss / tune_positions;
+}
+
+// Find the sigmoid scaling K that fits the current weights best:
+double tune_fit_scaling(int threads)
+{
+	double k = 1.0, step = 0.5, best = tune_loss(k, threads, NULL);
+	while (step > 0.001)
+	{
+		double up = tune_loss(k + step, threads, NULL), down = (k - step > 0.0) ? tune_loss(k - step, threads, NULL) : best;
+		if (up < best)
+			k += step, best = up;
+		else if (down < best)
+			k -= step, best = down;
+		else
+			step /= 2.0;
+	}
+	return k;
+}
+
+// Round a tuned weight:
+static inline int tuned(int weight)
+{
+	double value = tune_weight[weight];
+	return (int)((value < 0.0) ? value - 0.5 : value + 0.5);
+}
+
+// Print the tuned weights as C source:
+void print_tune_weights()
+{
+	char *phases[2] = {"Opening", "Endgame"};
+	char *types[6] = {"Pawn", "Knight", "Bishop", "Rook", "Queen", "King"};
+	printf("\n// Material score [game phase][piece]:\nconst int material_score[2][12] = {\n");
+	for (int phase = opening; phase <= endgame; phase++)
+	{
+		printf("\t\t// %s material score:\n\t\t", phases[phase]);
+		for (int type = PAWN; type <= KING; type++)
+			printf("%d, ", tuned(tune_material + phase * 6 + type));
+		for (int type = PAWN; type <= KING; type++)
+			printf((type < KING) ? "%d, " : (phase == opening) ? "%d,\n" : "%d};\n", -tuned(tune_material + phase * 6 + type));
+	}
+	printf("\n// Positional piece scores [game phase][piece][square]:\nconst int positional_score[2][6][64] = {\n");
+	for (int phase = opening; phase <= endgame; phase++)
+	{
+		printf("\t\t/*\n\t\t\t%s POSITIONAL PIECE SCORES\n\t\t*/\n", (phase == opening) ? "OPENING" : "ENDGAME");
+		for (int type = PAWN; type <= KING; type++)
+		{
+			printf("\t\t// %s:\n", types[type]);
+			for (int square = 0; square < 64; square++)
+				printf("%s%d%s", (square & 7) ? "" : "\t\t", tuned(tune_positional + (phase * 6 + type) * 64 + square),
+							 (phase == endgame && type == KING && square == 63) ? "};\n" : ((square & 7) == 7) ? ",\n" : ", ");
+		}
+	}
+	printf("\n// Double pawns penalty:\nconst int double_pawn_penalty_opening = %d;\nconst int double_pawn_penalty_endgame = %d;\n",
+				 tuned(tune_double_pawn + opening), tuned(tune_double_pawn + endgame));
+	printf("\n// Isolated pawns penalty:\nconst int isolated_pawn_penalty_opening = %d;\nconst int isolated_pawn_penalty_endgame = %d;\n",
+				 tuned(tune_isolated_pawn + opening), tuned(tune_isolated_pawn + endgame));
+	printf("\n// Passed pawns bonus:\nconst int passed_pawn_bonus[8] = {");
+	for (int rank = 0; rank < 8; rank++)
+		printf((rank < 7) ? "%d, " : "%d};\n", tuned(tune_passed_pawn + rank));
+	printf("\n// Semi open file score:\nconst int semi_open_file_score = %d;\n", tuned(tune_semi_open_file));
+	printf("\n// Open file score:\nconst int open_file_score = %d;\n", tuned(tune_open_file));
+	printf("\n// Mobility bonuses:\nstatic const int bishop_mobility_opening = %d;\nstatic const int bishop_mobility_endgame = %d;\n",
+				 tuned(tune_bishop_mobility + opening), tuned(tune_bishop_mobility + endgame));
+	printf("static const int queen_mobility_opening = %d;\nstatic const int queen_mobility_endgame = %d;\n",
+				 tuned(tune_queen_mobility + opening), tuned(tune_queen_mobility + endgame));
+	printf("\n// Kings shield bonus:\nconst int king_shield_bonus = %d;\n", tuned(tune_king_shield));
+}
+
+// Tune the evaluation weights on the positions of an EPD file (Adam on the mean squared error):
+void tune(char *path, int epochs, int threads)
+{
+	// Clamp the number of threads:
+	threads = (threads < 1) ? 1 : (threads > max_threads) ? max_threads : threads;
+	// Start from the current weights:
+	init_tune_weights();
+	long start = get_time_ms();
+	if (!load_tune_positions(path))
+	{
+		printf("No positions loaded from %s\n", path);
+		return;
+	}
+	printf("Loading time: %ldms\n", get_time_ms() - start);
+	// Fit the sigmoid to the current weights:
+	double k = tune_fit_scaling(threads);
+	printf("Scaling K: %.4f\n", k);
+	// Adam state:
+	double *grad = calloc(tune_weights, sizeof(double));
+	double *mean = calloc(tune_weights, sizeof(double));
+	double *variance = calloc(tune_weights, sizeof(double));
+	double beta1 = 0.9, beta2 = 0.999, decay1 = 1.0, decay2 = 1.0;
+	// Loss evaluation throughput:
+	U64 evaluated = 0;
+	start = get_time_ms();
+	for (int epoch = 1; epoch <= epochs; epoch++)
+	{
+		// Loss and gradient over all positions:
+		double loss = tune_loss(k, threads, grad);
+		evaluated += tune_positions;
+		// Adam step:
+		decay1 *= beta1, decay2 *= beta2;
+		for (int weight = 0; weight < tune_weights; weight++)
+		{
+			mean[weight] = beta1 * mean[weight] + (1.0 - beta1) * grad[weight];
+			variance[weight] = beta2 * variance[weight] + (1.0 - beta2) * grad[weight] * grad[weight];
+			tune_weight[weight] -= tune_rate * (mean[weight] / (1.0 - decay1)) / (sqrt(variance[weight] / (1.0 - decay2)) + 1e-8);
+		}
+		// Report progress:
+		if (epoch == 1 || epoch % 10 == 0 || epoch == epochs)
+		{
+			long time_spent = get_time_ms() - start;
+			printf("Epoch %d loss %.6f positions/second %lld\n", epoch, loss, (long long)(evaluated * 1000 / (time_spent + 1)));
+		}
+	}
+	printf("Final loss: %.6f\n", tune_loss(k, threads, NULL));
+	// Print the new tables:
+	print_tune_weights();
+	free(grad);
+	free(mean);
+	free(variance);
+	free_tune_positions();
+}
+
 /******************************************************************************\
 ==================================== UCI =======================================
 \******************************************************************************/
 
 // Parse the user/GUI move string input (e.g "e7e8q"):
-int parse_move(char *move_string)
+int parse_move(position *pos, char *move_string)
 {
 	// Inititalize a move list instance:
 	moves move_list[1];
 	// Generate the moves:
-	generate_moves(move_list);
+	generate_moves(pos, move_list);
 	// Parse the squares:
 	int source_square = (move_string[0] - 'a') + (8 - (move_string[1] - '0')) * 8;
 	int target_square = (move_string[2] - 'a') + (8 - (move_string[3] - '0')) * 8;
@@ -4115,6 +7560,8 @@ int parse_move(char *move_string)
 // Parse UCI <position> command:
 void parse_position(char *command)
 {
+	// Set up the game position:
+	position *pos = &root_position;
 	// Shift pointer to the right where next token begins:
 	command += 9;
 	// Initialize pointer to the current char int the commmand string:
@@ -4123,7 +7570,7 @@ void parse_position(char *command)
 	if (strncmp(command, "startpos", 8) == 0)
 	{
 		// Initialize chess board with starting position:
-		parse_fen(start_position);
+		parse_fen(pos, start_position);
 	}
 	// Parse UCI "fen" command:
 	else
@@ -4134,7 +7581,7 @@ void parse_position(char *command)
 		if (current_char == NULL)
 		{
 			// Initialize chess board with starting position:
-			parse_fen(start_position);
+			parse_fen(pos, start_position);
 		}
 		// If FEN command is available:
 		else
@@ -4142,7 +7589,7 @@ void parse_position(char *command)
 			// Shift pointer to the right where next token begins:
 			current_char += 4;
 			// Initialize chess board with fen string:
-			parse_fen(current_char);
+			parse_fen(pos, current_char);
 		}
 	}
 	// Parse moves after position:
@@ -4156,7 +7603,7 @@ void parse_position(char *command)
 		while (*current_char)
 		{
 			// Parse next move:
-			int move = parse_move(current_char);
+			int move = parse_move(pos, current_char);
 			// If no more moves:
 			if (move == 0)
 			{
@@ -4164,10 +7611,12 @@ void parse_position(char *command)
 				break;
 			}
 			// Increment repetition index and store the hash key:
-			repetition_index++;
-			repetition_table[repetition_index] = hash_key;
+			pos->repetition_index++;
+			pos->repetition_table[pos->repetition_index] = pos->hash_key;
+			// Move undo information (the move is never taken back):
+			undo state[1];
 			// Make move on the chess board:
-			make_move(move, all_moves);
+			make_move(pos, move, all_moves, state);
 			// Move current char pointer to the end of current move:
 			while (*current_char && *current_char != ' ')
 			{
@@ -4178,7 +7627,7 @@ void parse_position(char *command)
 		}
 	}
 	// Print the board:
-	print_board();
+	print_board(pos);
 }
 
 // Reset time control variables:
@@ -4188,7 +7637,7 @@ void reset_time_control()
 	quit = 0;
 	movestogo = 30;
 	movetime = -1;
-	time = -1;
+	time_left = -1;
 	inc = 0;
 	starttime = 0;
 	stoptime = 0;
@@ -4199,7 +7648,9 @@ void reset_time_control()
 // Parse UCI <go> command:
 void parse_go(char *command)
 {
-	// Reset time control:
+	// Search the game position:
+	position *pos = &root_position;
+	// Reset time_left control:
 	reset_time_control();
 	// Init parameters:
 	int depth = -1;
@@ -4210,28 +7661,28 @@ void parse_go(char *command)
 	{
 	}
 	// Match UCI <binc> command:
-	if ((argument = strstr(command, "binc")) && side == black)
+	if ((argument = strstr(command, "binc")) && pos->side == black)
 	{
-		// Parse black time increment:
+		// Parse black time_left increment:
 		inc = atoi(argument + 5);
 	}
 	// Match UCI <winc> command:
-	if ((argument = strstr(command, "winc")) && side == white)
+	if ((argument = strstr(command, "winc")) && pos->side == white)
 	{
-		// Parse white time increment:
+		// Parse white time_left increment:
 		inc = atoi(argument + 5);
 	}
 	// Match UCI <wtime> command:
-	if ((argument = strstr(command, "wtime")) && side == white)
+	if ((argument = strstr(command, "wtime")) && pos->side == white)
 	{
-		// Parse white time limit:
-		time = atoi(argument + 6);
+		// Parse white time_left limit:
+		time_left = atoi(argument + 6);
 	}
 	// Match UCI <btime> command:
-	if ((argument = strstr(command, "btime")) && side == black)
+	if ((argument = strstr(command, "btime")) && pos->side == black)
 	{
-		// Parse black time limit:
-		time = atoi(argument + 6);
+		// Parse black time_left limit:
+		time_left = atoi(argument + 6);
 	}
 	// Match UCI <movestogo> command:
 	if ((argument = strstr(command, "movestogo")))
@@ -4242,7 +7693,7 @@ void parse_go(char *command)
 	// Match UCI <movetime> command:
 	if ((argument = strstr(command, "movetime")))
 	{
-		// Parse amount of time allowed to spend to make a move:
+		// Parse amount of time_left allowed to spend to make a move:
 		movetime = atoi(argument + 9);
 	}
 	// Match UCI <depth> command:
@@ -4251,34 +7702,34 @@ void parse_go(char *command)
 		// Parse search depth:
 		depth = atoi(argument + 6);
 	}
-	// If move time is not available:
+	// If move time_left is not available:
 	if (movetime != -1)
 	{
-		// Set time equal to move time:
-		time = movetime;
+		// Set time_left equal to move time_left:
+		time_left = movetime;
 		// Set moves to go to 1:
 		movestogo = 1;
 	}
-	// Initializate start time:
+	// Initializate start time_left:
 	starttime = get_time_ms();
 	// Initializate search depth:
 	depth = depth;
-	// If time control is available:
-	if (time != -1)
+	// If time_left control is available:
+	if (time_left != -1)
 	{
-		// Flag we're playing with time control:
+		// Flag we're playing with time_left control:
 		timeset = 1;
 		// Set up timing:
-		time /= movestogo;
+		time_left /= movestogo;
 		// "Illegal" (empty) move bug fix:
-		if (time > 1500)
+		if (time_left > 1500)
 		{
-			time -= 50;
+			time_left -= 50;
 		}
 		// Initializate stotime:
-		stoptime = starttime + time + inc;
-		// Treat increment as seconds per move when time is almost up:
-		if (time < 1500 && inc && depth == 64)
+		stoptime = starttime + time_left + inc;
+		// Treat increment as seconds per move when time_left is almost up:
+		if (time_left < 1500 && inc && depth == 64)
 		{
 			stoptime = starttime + inc - 50;
 		}
@@ -4290,16 +7741,14 @@ void parse_go(char *command)
 		depth = 64;
 	}
 	// Print debug info:
-	printf("time:%d start:%u stop:%u depth:%d timeset:%d\n", time, starttime, stoptime, depth, timeset);
+	printf("time:%d start:%u stop:%u depth:%d timeset:%d\n", time_left, starttime, stoptime, depth, timeset);
 	// Search position:
-	search_position(depth);
+	search_position(pos, depth);
 }
 
 // Main UCI loop:
 void uci_loop()
 {
-	// Max hash MB:
-	int max_hash = 128;
 	// Default MB size:
 	int mb = 64;
 	// Reset STDIN/STDOUT buffers:
@@ -4311,7 +7760,15 @@ void uci_loop()
 	printf("id name BBC %s\n", version);
 	printf("id author CMK & Derlexy\n");
 	printf("option name Hash type spin default 64 min 4 max %d\n", max_hash);
+	printf("option name Threads type spin default 1 min 1 max %d\n", max_threads);
+	printf("option name PerftHash type spin default 0 min 0 max %d\n", max_hash);
+	printf("option name PerftBulk type check default true\n");
+	printf("option name EvalCache type spin default %d min 0 max %d\n", eval_cache_default, max_hash);
+	printf("option name EvalFile type string default <empty>\n");
+	printf("option name UseNNUE type check default false\n");
 	printf("uciok\n");
+	// Report the memory page modes:
+	printf("info string hash table %dMB on %s, slider tables on %s\n", hash_mb, page_mode_names[hash_page_mode], page_mode_names[slider_page_mode]);
 	// Main loop:
 	while (1)
 	{
@@ -4342,18 +7799,43 @@ void uci_loop()
 		// Parse UCI <position> command:
 		else if (strncmp(input, "position", 8) == 0)
 		{
-			// Call parse position function:
+			// Call parse position function (the hash table stays warm between moves):
 			parse_position(input);
-			// Clear hash table:
-			clear_hash_table();
 		}
 		// Parse UCI <ucinewgame> command:
 		else if (strncmp(input, "ucinewgame", 10) == 0)
 		{
 			// Call parse position function:
 			parse_position("position startpos");
-			// Clear hash table:
+			// Clear hash table and evaluation cache:
 			clear_hash_table();
+			clear_eval_cache();
+		}
+		// Parse <bench [depth] [threads] [hash]> command (search signature and speed):
+		else if (strncmp(input, "bench", 5) == 0)
+		{
+			// Parse optional arguments:
+			int depth = bench_depth, threads = bench_threads, bench_mb = bench_hash;
+			sscanf(input + 5, "%d %d %d", &depth, &threads, &bench_mb);
+			// Run the bench (clamps its arguments):
+			bench(depth, threads, bench_mb);
+			// Restore hash table size:
+			init_hash_table(mb);
+		}
+		// Parse <perftsuite> command (known node counts, must come before <perft>):
+		else if (strncmp(input, "perftsuite", 10) == 0)
+		{
+			// Run the perft suite:
+			perft_suite();
+		}
+		// Parse <perft depth [threads n]> command (divide on the current position):
+		else if (strncmp(input, "perft", 5) == 0)
+		{
+			// Parse depth and threads:
+			int depth = atoi(input + 5);
+			char *threads = strstr(input, "threads");
+			// Run PERFT test:
+			perft_test_parallel(&root_position, (depth > 0) ? depth : 1, threads ? atoi(threads + 7) : 1);
 		}
 		// Parse UCI <go> command:
 		else if (strncmp(input, "go", 2) == 0)
@@ -4367,6 +7849,27 @@ void uci_loop()
 			// Quit from the chess engine program execution:
 			break;
 		}
+		// Parse <stats> command (statistics of the last search):
+		else if (strncmp(input, "stats", 5) == 0)
+		{
+			// Print search statistics:
+			print_search_stats();
+		}
+		// Parse <tune file [epochs] [threads]> command (Texel tuning of the evaluation weights):
+		else if (strncmp(input, "tune ", 5) == 0)
+		{
+			// Parse file and optional arguments:
+			char path[256];
+			int epochs = tune_epochs, threads = thread_count;
+			if (sscanf(input + 5, "%255s %d %d", path, &epochs, &threads) >= 1)
+				tune(path, (epochs > 0) ? epochs : tune_epochs, threads);
+		}
+		// Parse <speedtest [sliders|unmake|legal|perfthash|bulk]> command (compare backends):
+		else if (strncmp(input, "speedtest", 9) == 0)
+		{
+			// Run the speed test:
+			speed_test(input + 9);
+		}
 		// Parse UCI <uci> command:
 		else if (strncmp(input, "uci", 3) == 0)
 		{
@@ -4392,10 +7895,90 @@ void uci_loop()
 				// Adjust MB:
 				mb = max_hash;
 			}
-			// Set hash table size in MB:
-			printf("Set hash table size to %dMB\n", mb);
 			// Initializate the hash table:
 			init_hash_table(mb);
+			// Print the hash table size (rounded down to a power of two) and page mode:
+			printf("Set hash table size to %dMB (%s)\n", hash_mb, page_mode_names[hash_page_mode]);
+		}
+		// Setup the perft hash table MB size (0 disables it):
+		else if (!strncmp(input, "setoption name PerftHash value ", 31))
+		{
+			// Initialize MB:
+			int perft_mb = 0;
+			sscanf(input, "%*s %*s %*s %*s %d", &perft_mb);
+			// Adjust MB to the allowed bounds:
+			perft_mb = (perft_mb < 0) ? 0 : (perft_mb > max_hash) ? max_hash : perft_mb;
+			// Initialize the perft hash table:
+			init_perft_hash_table(perft_mb);
+			// Print the perft hash size:
+			printf("Set perft hash table size to %dMB\n", perft_hash_mb);
+		}
+		// Setup the evaluation cache MB size (0 disables it):
+		else if (!strncmp(input, "setoption name EvalCache value ", 31))
+		{
+			// Initialize MB:
+			int eval_mb = 0;
+			sscanf(input, "%*s %*s %*s %*s %d", &eval_mb);
+			// Adjust MB to the allowed bounds:
+			eval_mb = (eval_mb < 0) ? 0 : (eval_mb > max_hash) ? max_hash : eval_mb;
+			// Initialize the evaluation cache:
+			init_eval_cache(eval_mb);
+			// Print the evaluation cache size:
+			printf("Set evaluation cache size to %dMB\n", eval_cache_mb);
+		}
+		// Load an NNUE network file (switches NNUE on):
+		else if (!strncmp(input, "setoption name EvalFile value ", 30))
+		{
+			// Strip the line ending from the path:
+			char *path = input + 30;
+			path[strcspn(path, "\r\n")] = '\0';
+			// Load the network:
+			if (load_network(path))
+				printf("info string NNUE network %s loaded (%s)\n", path, nnue_backend_name());
+			else
+				printf("info string failed to load NNUE network %s, using the handcrafted evaluation\n", path);
+			// Cached evaluations and the game position accumulators belong to the previous evaluation:
+			clear_eval_cache();
+			refresh_accumulators(&root_position);
+		}
+		// Switch between the network and the handcrafted evaluation:
+		else if (!strncmp(input, "setoption name UseNNUE value ", 29))
+		{
+			// Only switch on with a loaded network:
+			use_nnue = !strncmp(input + 29, "true", 4) && network.data != NULL;
+			// Cached evaluations and the game position accumulators belong to the previous evaluation:
+			clear_eval_cache();
+			refresh_accumulators(&root_position);
+			// Print the evaluation in use:
+			printf("info string using the %s evaluation\n", use_nnue ? "NNUE" : "handcrafted");
+		}
+		// Switch perft bulk counting (off validates make/unmake down to the leaves):
+		else if (!strncmp(input, "setoption name PerftBulk value ", 31))
+		{
+			// Parse the switch:
+			perft_bulk_counting = !strncmp(input + 31, "true", 4);
+			// Print the switch state:
+			printf("Set perft bulk counting %s\n", perft_bulk_counting ? "on" : "off");
+		}
+		// Setup the number of search threads:
+		else if (!strncmp(input, "setoption name Threads value ", 29))
+		{
+			// Initialize thread count:
+			sscanf(input, "%*s %*s %*s %*s %d", &thread_count);
+			// Adjust thread count if going under the allowed bound:
+			if (thread_count < 1)
+			{
+				// Adjust thread count:
+				thread_count = 1;
+			}
+			// Adjust thread count if going over the allowed bound:
+			if (thread_count > max_threads)
+			{
+				// Adjust thread count:
+				thread_count = max_threads;
+			}
+			// Print the number of threads:
+			printf("Set search threads to %d\n", thread_count);
 		}
 	}
 }
@@ -4407,11 +7990,16 @@ void uci_loop()
 // Initialize all variables:
 void init_all()
 {
+	// Detect CPU features:
+	init_cpu_features();
 	// Initialize leaper pieces attacks:
 	init_leapers_attacks();
 	// Initialize sliders pieces attacks:
+	init_slider_tables();
 	init_sliders_attacks(bishop);
 	init_sliders_attacks(rook);
+	// Initialize between and line masks:
+	init_line_masks();
 	/*
 	// Initialize magic numbers:
 	init_magic_numbers();
@@ -4421,31 +8009,63 @@ void init_all()
 	init_random_keys();
 	// Initalize evaluation masks:
 	init_evaluation_masks();
+	// Initialize incremental evaluation scores:
+	init_piece_square_scores();
+	// Initialize NNUE feature indices:
+	init_nnue_features();
 	// Initializate hash table with 64 megabytes:
 	init_hash_table(64);
+	// Initialize the evaluation cache:
+	init_eval_cache(eval_cache_default);
 }
 
 /******************************************************************************\
 ================================= MAIN DRIVER ==================================
 \******************************************************************************/
 
-int main()
+int main(int argc, char *argv[])
 {
 	// Initialize all variables:
 	init_all();
 	// Debug mode variable:
 	int debug = 1;
+	// Exit code:
+	int status = 0;
+	// Run the speed test from the command line:
+	if (argc > 1 && strcmp(argv[1], "speedtest") == 0)
+	{
+		// Compare backends:
+		speed_test(argc > 2 ? argv[2] : "");
+	}
+	// Run the bench from the command line (bench [depth] [threads] [hash]):
+	else if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		// Search the bench positions:
+		bench((argc > 2) ? atoi(argv[2]) : bench_depth, (argc > 3) ? atoi(argv[3]) : bench_threads, (argc > 4) ? atoi(argv[4]) : bench_hash);
+	}
+	// Tune the evaluation weights from the command line (tune file [epochs] [threads]):
+	else if (argc > 2 && strcmp(argv[1], "tune") == 0)
+	{
+		// Tune on the positions of the file:
+		tune(argv[2], (argc > 3) ? atoi(argv[3]) : tune_epochs, (argc > 4) ? atoi(argv[4]) : 1);
+	}
+	// Run the perft suite from the command line (fails on any mismatch):
+	else if (argc > 1 && strcmp(argv[1], "perftsuite") == 0)
+	{
+		// Check the move generator:
+		status = perft_suite() ? 1 : 0;
+	}
 	// If debug mode is enabled:
-	if (debug)
+	else if (debug)
 	{
 		// Parse FEN:
-		parse_fen(start_position);
+		parse_fen(&root_position, start_position);
 		// Print the board:
-		print_board();
+		print_board(&root_position);
 		// Print the score of current position:
-		printf("Score: %d\n", evaluate());
+		printf("Score: %d\n", evaluate(&root_position, NULL));
 		// Search position:
-		// search_position(10);
+		// search_position(&root_position, 10);
 	}
 	// If debug mode is disabled:
 	else
@@ -4454,7 +8074,9 @@ int main()
 		uci_loop();
 	}
 	// Free hash table memory on exit:
-	free(hash_table);
+	large_page_free(hash_table, hash_buckets * sizeof(tt), hash_page_mode);
+	// Free pawn hash tables and evaluation cache memory:
+	free_eval_tables();
 	// Return:
-	return 0;
+	return status;
 }
\ No newline at end of file